@@ -0,0 +1,70 @@
+/* C interface of Rpairix for other R packages (LinkingTo: Rpairix).
+ *
+ * The functions are registered by Rpairix with R_RegisterCCallable and fetched here with R_GetCCallable on first use;
+ * Rpairix must be loaded first (e.g. Imports: Rpairix and an import in the NAMESPACE). A minimal accumulator counting
+ * the lines of each key:
+ *
+ *   static void *init(const ti_index_t *idx, void *arg) { return calloc(*(int*)arg, sizeof(double)); }
+ *   static int add(void *acc, const char *s, int len, const ti_intv_t *intv, void *arg) { ((double*)acc)[intv->tid]++; return 0; }
+ *   static void merge(void *acc, void *other, void *arg) { int i; for (i = 0; i < *(int*)arg; ++i) ((double*)acc)[i] += ((double*)other)[i]; }
+ *   static void destroy(void *acc, void *arg) { free(acc); }
+ *
+ *   ti_accumulator_t counter = { init, add, merge, destroy };
+ *   ti_index_t *idx = Rpairix_index_load(fn);
+ *   const char **keys = Rpairix_seqname(idx, &nkeys);
+ *   if (Rpairix_apply(fn, idx, 4, &counter, &nkeys, &result) == 0) { ... destroy(result, &nkeys); }
+ *   free(keys); Rpairix_index_destroy(idx);
+ */
+
+#ifndef __RPAIRIX_H
+#define __RPAIRIX_H
+
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+#include "pairix_apply.h"
+
+/* Load the index of the data file <fn> (<fn>.px2). Return NULL on failure. */
+static R_INLINE ti_index_t *Rpairix_index_load(const char *fn)
+{
+	static ti_index_t *(*fun)(const char*) = NULL;
+	if (fun == NULL) fun = (ti_index_t *(*)(const char*))R_GetCCallable("Rpairix", "ti_index_load");
+	return fun(fn);
+}
+
+/* Destroy an index loaded by Rpairix_index_load. */
+static R_INLINE void Rpairix_index_destroy(ti_index_t *idx)
+{
+	static void (*fun)(ti_index_t*) = NULL;
+	if (fun == NULL) fun = (void (*)(ti_index_t*))R_GetCCallable("Rpairix", "ti_index_destroy");
+	fun(idx);
+}
+
+/* Names of the keys (chromosomes or chromosome pairs), indexed by tid. The strings belong to the index; the array
+ * must be freed with free(). The number of keys is stored in <n>. */
+static R_INLINE const char **Rpairix_seqname(const ti_index_t *idx, int *n)
+{
+	static const char **(*fun)(const ti_index_t*, int*) = NULL;
+	if (fun == NULL) fun = (const char **(*)(const ti_index_t*, int*))R_GetCCallable("Rpairix", "ti_seqname");
+	return fun(idx, n);
+}
+
+/* Delimiter of the columns of the indexed file. */
+static R_INLINE char Rpairix_get_delimiter(ti_index_t *idx)
+{
+	static char (*fun)(ti_index_t*) = NULL;
+	if (fun == NULL) fun = (char (*)(ti_index_t*))R_GetCCallable("Rpairix", "ti_get_delimiter");
+	return fun(idx);
+}
+
+/* Scan all the data lines of the file <fn> indexed by <idx> on <n_threads> threads with the accumulator <acc>, and merge the
+ * partial results of the threads into *result (to be freed with acc->destroy). Returns 0 on success, -1 if the index has no
+ * block offset table, -2 if the file can't be opened or read and -3 if acc->add stopped the scan (see ti_apply). */
+static R_INLINE int Rpairix_apply(const char *fn, const ti_index_t *idx, int n_threads, const ti_accumulator_t *acc, void *arg, void **result)
+{
+	static int (*fun)(const char*, const ti_index_t*, int, const ti_accumulator_t*, void*, void**) = NULL;
+	if (fun == NULL) fun = (int (*)(const char*, const ti_index_t*, int, const ti_accumulator_t*, void*, void**))R_GetCCallable("Rpairix", "ti_apply");
+	return fun(fn, idx, n_threads, acc, arg, result);
+}
+
+#endif
@@ -0,0 +1,50 @@
+/* The MIT License
+
+   Copyright (c) 2009 Genome Research Ltd (GRL), 2010 Broad Institute
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+*/
+
+/* Types of the parallel scan engine (ti_apply), shared by src/pairix.h and the public header Rpairix.h. */
+
+#ifndef __PAIRIX_APPLY_H
+#define __PAIRIX_APPLY_H
+
+struct __ti_index_t;
+typedef struct __ti_index_t ti_index_t;
+
+/* interval of a data line: tid of its key (chromosome or chromosome pair), 0-based half-open positions and bins */
+typedef struct {
+        int tid, beg, end, bin, beg2, end2, bin2;
+} ti_intv_t;
+
+/* an accumulator of ti_apply. <init> returns the empty partial result of a worker thread. <add> is called on each data line
+ * of the ranges scanned by the worker, with its interval (tid, 0-based half-open positions); a negative return value
+ * stops the scan. <merge> adds the partial result <other> into <acc>, and <destroy> frees a partial result. <arg> is
+ * the argument given to ti_apply. <add> is called concurrently on the partial results of different workers. */
+typedef struct {
+        void *(*init)(const ti_index_t *idx, void *arg);
+        int (*add)(void *acc, const char *s, int len, const ti_intv_t *intv, void *arg);
+        void (*merge)(void *acc, void *other, void *arg);
+        void (*destroy)(void *acc, void *arg);
+} ti_accumulator_t;
+
+#endif
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include "bgzf.h"
 
 #ifdef _USE_KNETFILE
@@ -168,59 +169,55 @@ BGZF *bgzf_dopen(int fd, const char *mode)
 	return fp;
 }
 
+// Deflate src[0..input_length) into a BGZF block at dst (BGZF_BLOCK_SIZE bytes), with the extra field that stores the
+// compressed block length. Returns the compressed length, 0 if the block does not fit, -1 on error.
+static int deflate_buffer(uint8_t *dst, const uint8_t *src, int input_length, int compress_level)
+{
+	int status, compressed_length;
+	uint32_t crc;
+	z_stream zs;
+	memcpy(dst, g_magic, BLOCK_HEADER_LENGTH); // the last two bytes are a place holder for the length of the block
+	zs.zalloc = NULL;
+	zs.zfree = NULL;
+	zs.next_in = (Bytef*)src;
+	zs.avail_in = input_length;
+	zs.next_out = (void*)&dst[BLOCK_HEADER_LENGTH];
+	zs.avail_out = BGZF_BLOCK_SIZE - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
+	status = deflateInit2(&zs, compress_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); // -15 to disable zlib header/footer
+	if (status != Z_OK) return -1;
+	status = deflate(&zs, Z_FINISH);
+	if (status != Z_STREAM_END) { // not compressed enough
+		deflateEnd(&zs);
+		return status == Z_OK? 0 : -1;
+	}
+	if (deflateEnd(&zs) != Z_OK) return -1;
+	compressed_length = zs.total_out + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
+	assert(compressed_length <= BGZF_BLOCK_SIZE);
+	packInt16((uint8_t*)&dst[16], compressed_length - 1); // write the compressed_length; -1 to fit 2 bytes
+	crc = crc32(0L, NULL, 0L);
+	crc = crc32(crc, src, input_length);
+	packInt32((uint8_t*)&dst[compressed_length-8], crc);
+	packInt32((uint8_t*)&dst[compressed_length-4], input_length);
+	return compressed_length;
+}
+
 // Deflate the block in fp->uncompressed_block into fp->compressed_block. Also adds an extra field that stores the compressed block length.
 static int deflate_block(BGZF *fp, int block_length)
 {
-	uint8_t *buffer = fp->compressed_block;
-	int buffer_size = BGZF_BLOCK_SIZE;
 	int input_length = block_length;
-	int compressed_length = 0;
+	int compressed_length;
 	int remaining;
-	uint32_t crc;
 
 	assert(block_length <= BGZF_BLOCK_SIZE); // guaranteed by the caller
-	memcpy(buffer, g_magic, BLOCK_HEADER_LENGTH); // the last two bytes are a place holder for the length of the block
-	while (1) { // loop to retry for blocks that do not compress enough
-		int status;
-		z_stream zs;
-		zs.zalloc = NULL;
-		zs.zfree = NULL;
-		zs.next_in = fp->uncompressed_block;
-		zs.avail_in = input_length;
-		zs.next_out = (void*)&buffer[BLOCK_HEADER_LENGTH];
-		zs.avail_out = buffer_size - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
-		status = deflateInit2(&zs, fp->compress_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); // -15 to disable zlib header/footer
-		if (status != Z_OK) {
-			fp->errcode |= BGZF_ERR_ZLIB;
-			return -1;
-		}
-		status = deflate(&zs, Z_FINISH);
-		if (status != Z_STREAM_END) { // not compressed enough
-			deflateEnd(&zs); // reset the stream
-			if (status == Z_OK) { // reduce the size and recompress
-				input_length -= 1024;
-				assert(input_length > 0); // logically, this should not happen
-				continue;
-			}
-			fp->errcode |= BGZF_ERR_ZLIB;
-			return -1;
-		}
-		if (deflateEnd(&zs) != Z_OK) {
-			fp->errcode |= BGZF_ERR_ZLIB;
-			return -1;
-		}
-		compressed_length = zs.total_out;
-		compressed_length += BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
-		assert(compressed_length <= BGZF_BLOCK_SIZE);
-		break;
+	while ((compressed_length = deflate_buffer(fp->compressed_block, fp->uncompressed_block, input_length, fp->compress_level)) == 0) {
+		// the block does not compress enough : reduce the size and recompress
+		input_length -= 1024;
+		assert(input_length > 0); // logically, this should not happen
+	}
+	if (compressed_length < 0) {
+		fp->errcode |= BGZF_ERR_ZLIB;
+		return -1;
 	}
-
-	assert(compressed_length > 0);
-	packInt16((uint8_t*)&buffer[16], compressed_length - 1); // write the compressed_length; -1 to fit 2 bytes
-	crc = crc32(0L, NULL, 0L);
-	crc = crc32(crc, fp->uncompressed_block, input_length);
-	packInt32((uint8_t*)&buffer[compressed_length-8], crc);
-	packInt32((uint8_t*)&buffer[compressed_length-4], input_length);
 
 	remaining = block_length - input_length;
 	if (remaining > 0) {
@@ -346,6 +343,31 @@ int bgzf_block_length(BGZF *fp, int64_t block_start_offset)
         return(block_length);
 }
 
+int bgzf_block_info(BGZF *fp, int64_t block_address, int *usize)
+{
+	uint8_t header[BLOCK_HEADER_LENGTH], footer[4];
+	int count, block_length;
+	*usize = 0;
+	if (_bgzf_seek(fp->fp, block_address, SEEK_SET) < 0) {
+		fp->errcode |= BGZF_ERR_IO;
+		return -1;
+	}
+	count = _bgzf_read(fp->fp, header, sizeof(header));
+	if (count == 0) return 0; // end of file
+	if (count != sizeof(header) || !check_header(header)) {
+		fp->errcode |= BGZF_ERR_HEADER;
+		return -1;
+	}
+	block_length = unpackInt16((uint8_t*)&header[16]) + 1;
+	if (_bgzf_seek(fp->fp, block_address + block_length - 4, SEEK_SET) < 0 || _bgzf_read(fp->fp, footer, 4) != 4) {
+		fp->errcode |= BGZF_ERR_IO;
+		return -1;
+	}
+	*usize = footer[0] | footer[1] << 8 | footer[2] << 16 | (uint32_t)footer[3] << 24; // ISIZE
+	fp->block_length = 0; // the file position has moved
+	return block_length;
+}
+
 int bgzf_read_block(BGZF *fp)
 {
 	uint8_t header[BLOCK_HEADER_LENGTH], *compressed_block;
@@ -381,6 +403,13 @@ int bgzf_read_block(BGZF *fp)
 	return 0;
 }
 
+int64_t bgzf_load_block(BGZF *fp, int64_t block_address)
+{
+	if (bgzf_seek(fp, block_address << 16, SEEK_SET) < 0) return -1;
+	if (bgzf_read_block(fp) != 0) return -1;
+	return _bgzf_tell((_bgzf_file_t)fp->fp);
+}
+
 ssize_t bgzf_read(BGZF *fp, void *data, ssize_t length)
 {
 	ssize_t bytes_read = 0;
@@ -425,6 +454,32 @@ int bgzf_flush(BGZF *fp)
 	return 0;
 }
 
+int bgzf_raw_copy(BGZF *fp, BGZF *fpin, int64_t beg, int64_t end)
+{
+	uint8_t *buffer = fp->compressed_block;
+	int64_t remaining = end - beg;
+	assert(fp->open_mode == 'w' && fpin->open_mode == 'r');
+	if (bgzf_flush(fp) != 0) return -1;
+	if (_bgzf_seek(fpin->fp, beg, SEEK_SET) < 0) {
+		fpin->errcode |= BGZF_ERR_IO;
+		return -1;
+	}
+	while (remaining > 0) { // the compressed buffer of fp is free after the flush
+		int count = remaining < BGZF_BLOCK_SIZE? remaining : BGZF_BLOCK_SIZE;
+		if (_bgzf_read(fpin->fp, buffer, count) != count) {
+			fpin->errcode |= BGZF_ERR_IO;
+			return -1;
+		}
+		if (fwrite(buffer, 1, count, fp->fp) != count) {
+			fp->errcode |= BGZF_ERR_IO;
+			return -1;
+		}
+		remaining -= count;
+	}
+	fp->block_address += end - beg;
+	return 0;
+}
+
 int bgzf_flush_try(BGZF *fp, ssize_t size)
 {
 	if (fp->block_offset + size > BGZF_BLOCK_SIZE)
@@ -574,3 +629,116 @@ int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 	str->s[str->l] = 0;
 	return str->l;
 }
+
+/*****************************
+ * multi-threaded compressor *
+ *****************************/
+
+#define BGZF_MT_INPUT_SIZE 0xff00 // uncompressed bytes per block; always fits in a block once compressed
+#define BGZF_MT_BLOCKS 16         // blocks per thread and round
+
+typedef struct {
+	uint8_t *in, *out;
+	int in_len, out_len, compress_level, error;
+	int n_blocks, block_len[BGZF_MT_BLOCKS]; // compressed size of each block
+} bgzf_mt_job_t;
+
+static void *bgzf_mt_deflate(void *data)
+{
+	bgzf_mt_job_t *job = (bgzf_mt_job_t*)data;
+	int o, l, c;
+	job->out_len = job->n_blocks = 0;
+	for (o = 0; o < job->in_len; o += l) {
+		l = job->in_len - o < BGZF_MT_INPUT_SIZE? job->in_len - o : BGZF_MT_INPUT_SIZE;
+		if ((c = deflate_buffer(job->out + job->out_len, job->in + o, l, job->compress_level)) <= 0) {
+			job->error = 1;
+			break;
+		}
+		job->out_len += c;
+		job->block_len[job->n_blocks++] = c;
+	}
+	return 0;
+}
+
+// pass the blocks of a written job to <func>, in file order
+static int bgzf_mt_blocks(const bgzf_mt_job_t *job, int64_t *addr, bgzf_block_f func, void *data)
+{
+	int i, o = 0;
+	for (i = 0; i < job->n_blocks; ++i) {
+		int l = job->in_len - o < BGZF_MT_INPUT_SIZE? job->in_len - o : BGZF_MT_INPUT_SIZE;
+		if (func && func(data, *addr, *addr + job->block_len[i], job->in + o, l) < 0) return -1;
+		*addr += job->block_len[i];
+		o += l;
+	}
+	return 0;
+}
+
+int bgzf_compress_file(const char *fnin, const char *fnout, int compress_level, int n_threads)
+{
+	return bgzf_compress_file2(fnin, fnout, compress_level, n_threads, 0, 0);
+}
+
+int bgzf_compress_file2(const char *fnin, const char *fnout, int compress_level, int n_threads, bgzf_block_f func, void *data)
+{
+	bgzf_mt_job_t *jobs;
+	pthread_t *tid;
+	int *started;
+	gzFile in;
+	FILE *out;
+	static const uint8_t eof[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+	int i, r, n, nprev = 0, ret = 0, done = 0, len = BGZF_MT_BLOCKS * BGZF_MT_INPUT_SIZE;
+	int64_t addr = 0;
+
+	if (n_threads < 1) n_threads = 1;
+	if (compress_level < 0 || compress_level > 9) compress_level = Z_DEFAULT_COMPRESSION;
+	if (strcmp(fnin, "-") == 0) { // read a duplicate of stdin, so that gzclose leaves the caller's stdin open
+		int fd = dup(fileno(stdin));
+		if (fd < 0) return -1;
+		if ((in = gzdopen(fd, "rb")) == 0) close(fd);
+	} else in = gzopen(fnin, "rb");
+	if (in == 0) return -1;
+	if ((out = fopen(fnout, "wb")) == 0) {
+		gzclose(in);
+		return -2;
+	}
+	jobs = (bgzf_mt_job_t*)calloc(2 * n_threads, sizeof(bgzf_mt_job_t));
+	tid = (pthread_t*)calloc(2 * n_threads, sizeof(pthread_t));
+	started = (int*)calloc(2 * n_threads, sizeof(int));
+	for (i = 0; i < 2 * n_threads; ++i) {
+		jobs[i].in = (uint8_t*)malloc(len);
+		jobs[i].out = (uint8_t*)malloc(BGZF_MT_BLOCKS * BGZF_BLOCK_SIZE);
+		jobs[i].compress_level = compress_level;
+	}
+	// the input of a round is compressed while the previous round is written and the next one is read
+	for (r = 0; ; ++r) {
+		bgzf_mt_job_t *cur = jobs + (r & 1) * n_threads, *prev = jobs + ((r + 1) & 1) * n_threads;
+		pthread_t *cur_tid = tid + (r & 1) * n_threads;
+		int *cur_started = started + (r & 1) * n_threads;
+		for (n = 0; n < n_threads && !done && ret == 0; ++n) {
+			int l = 0, c = 0;
+			while (l < len && (c = gzread(in, cur[n].in + l, len - l)) > 0) l += c;
+			if (c < 0) ret = -3;
+			if (l < len) done = 1;
+			if ((cur[n].in_len = l) == 0) break;
+			cur_started[n] = pthread_create(&cur_tid[n], 0, bgzf_mt_deflate, cur + n) == 0;
+			if (!cur_started[n]) bgzf_mt_deflate(cur + n); // no thread left: compress in this one
+		}
+		for (i = 0; i < nprev && ret == 0; ++i) {
+			if (prev[i].error) ret = -4;
+			else if (fwrite(prev[i].out, 1, prev[i].out_len, out) != (size_t)prev[i].out_len) ret = -2;
+			else if (bgzf_mt_blocks(prev + i, &addr, func, data) < 0) ret = -5;
+		}
+		for (i = 0; i < n; ++i)
+			if (cur_started[i]) pthread_join(cur_tid[i], 0);
+		if (n == 0) break;
+		nprev = n;
+	}
+	if (ret == 0 && fwrite(eof, 1, sizeof(eof), out) != sizeof(eof)) ret = -2; // empty block marking the end of file
+	if (ret == 0 && func && func(data, addr, addr, 0, 0) < 0) ret = -5;
+	for (i = 0; i < 2 * n_threads; ++i) { free(jobs[i].in); free(jobs[i].out); }
+	free(jobs); free(tid); free(started);
+	gzclose(in);
+	if (fclose(out) != 0 && ret == 0) ret = -2;
+	if (ret != 0) unlink(fnout); // do not leave a truncated file
+	return ret;
+}
@@ -57,6 +57,8 @@ typedef struct __kstring_t {
 } kstring_t;
 #endif
 
+typedef int (*bgzf_block_f)(void *data, int64_t block_address, int64_t next_address, const uint8_t *block, int length);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -147,6 +149,26 @@ extern "C" {
 	 */
 	 int bgzf_is_bgzf(const char *fn);
 
+	/**
+	 * Compress a plain text or gzip file into a BGZF file, with _n_threads_ threads deflating the blocks
+	 *
+	 * @param fnin            input file name
+	 * @param fnout           output file name
+	 * @param compress_level  zlib compression level (0-9); -1 for the default level
+	 * @return                0 on success; -1 if _fnin_ can't be opened, -2 on a write error,
+	 *                        -3 on a read error and -4 on a compression error; _fnout_ is removed on error
+	 */
+	int bgzf_compress_file(const char *fnin, const char *fnout, int compress_level, int n_threads);
+
+	/**
+	 * Same as bgzf_compress_file, reading the standard input if _fnin_ is "-". _func_ (if not NULL) is
+	 * called from the calling thread on each block once it is written, in file order, with the file
+	 * offsets of the block and of the next one and its uncompressed data; it is called last with a
+	 * length of 0 and the offset of the end-of-file block. If _func_ returns a negative value, the
+	 * compression stops and -5 is returned.
+	 */
+	int bgzf_compress_file2(const char *fnin, const char *fnout, int compress_level, int n_threads, bgzf_block_f func, void *data);
+
 	/*********************
 	 * Advanced routines *
 	 *********************/
@@ -191,6 +213,33 @@ extern "C" {
          */
         int bgzf_block_length(BGZF *fp, int64_t block_start_offset);
 
+	/**
+	 * Read the header and footer of the block starting at file offset _block_address_, without
+	 * inflating it. The uncompressed size of the block is stored in _usize_.
+	 *
+	 * @return       compressed size of the block; 0 at the end of the file and -1 on error
+	 */
+	int bgzf_block_info(BGZF *fp, int64_t block_address, int *usize);
+
+	/**
+	 * Load the block starting at file offset _block_address_. The uncompressed data is in
+	 * fp->uncompressed_block (fp->block_length bytes; 0 at the end of the file).
+	 *
+	 * @return       file offset of the next block; -1 on error
+	 */
+	int64_t bgzf_load_block(BGZF *fp, int64_t block_address);
+
+	/**
+	 * Append the compressed blocks of _fpin_ between file offsets _beg_ and _end_ (block boundaries)
+	 * to _fp_ without recompressing them. _fp_ is flushed first. _fpin_ must be repositioned with
+	 * bgzf_seek() or bgzf_load_block() before it is read again.
+	 *
+	 * @param fp     BGZF file handler opened for writing
+	 * @param fpin   BGZF file handler opened for reading
+	 * @return       0 on success and -1 on error
+	 */
+	int bgzf_raw_copy(BGZF *fp, BGZF *fpin, int64_t beg, int64_t end);
+
 #ifdef __cplusplus
 }
 #endif
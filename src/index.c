@@ -1,6 +1,9 @@
 #include <ctype.h>
+#include <math.h>
 #include <assert.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "khash.h"
 #include "ksort.h"
 #include "kstring.h"
@@ -30,6 +33,15 @@ int MAX_CHR = MAX_CHR_LARGE_CHR;
 #define OLD_MAGIC_NUMBER2 "PX2.003\1"  // magic number for older version of pairix (0.3.4 - 0.3.5)
 #define OLD_MAGIC_NUMBER "PX2.002\1"  // magic number for older version of pairix (up to 0.3.3)
 
+/* Optional sections appended after the linear indices. Each section is a 4-byte tag followed by
+ * a 64-bit payload length, so that readers (including older versions of pairix) can skip
+ * sections they do not know about. */
+#define EXT_TAG_KEYSTATS "KST\1"
+#define KEYSTAT_RECORD_SIZE 48
+#define EXT_TAG_CHUNKSTATS "CST\1"
+#define EXT_TAG_BLOCKTABLE "BOT\1"
+#define EXT_TAG_READINDEX "RID\1"
+
 
 typedef struct {
 	uint64_t u, v;
@@ -37,6 +49,7 @@ typedef struct {
 
 #define pair64_lt(a,b) ((a).u < (b).u)
 KSORT_INIT(offt, pair64_t, pair64_lt)
+KSORT_INIT_GENERIC(uint64_t)
 
 typedef struct {
 	uint32_t m, n;
@@ -51,6 +64,27 @@ typedef struct {
 KHASH_MAP_INIT_INT(i, ti_binlist_t)
 KHASH_MAP_INIT_STR(s, int)
 
+typedef struct {
+	int32_t n, m;
+	int *tid;
+} ti_tidlist_t;
+
+// secondary index on a read name column : for each line, the hash of its read name (upper 32 bits) and the entry of
+// the block offset table of the block in which it starts (lower 32 bits), sorted and without duplicates
+typedef struct {
+	int32_t col; // 0-based column of the read names
+	int64_t n, m;
+	uint64_t *a;
+} ti_readindex_t;
+
+// chromosome of one mate -> tids of the chromosome pairs containing it
+typedef struct {
+	khash_t(s) *h; // chromosome name -> index in names and tids
+	int32_t n, m;
+	char **names;
+	ti_tidlist_t *tids;
+} ti_matemap_t;
+
 struct __ti_index_t {
         ti_conf_t conf;
         int32_t n, max;
@@ -58,6 +92,11 @@ struct __ti_index_t {
         khash_t(i) **index;
         ti_lidx_t *index2;
         uint64_t linecount;
+        ti_keystat_t *keystats; // per-key summary; NULL for an index built by an older version
+        ti_matemap_t matemap[2]; // mate1 and mate2 chromosome maps; built when the index is loaded
+        ti_chunkstats_t *chunkstats; // per-block column statistics; NULL unless requested when indexing
+        ti_blocktable_t *blocks; // block offset table; NULL for an index built by an older version
+        ti_readindex_t *reads; // read name index; NULL unless requested (ti_index_reads)
 };
 
 struct __ti_iter_t {
@@ -68,6 +107,8 @@ struct __ti_iter_t {
         const ti_index_t *idx;
         pair64_t *off;
         ti_intv_t intv;
+        const uint8_t *skip; // per block of idx->chunkstats, 1 if the records starting in the block can be skipped
+        int skip_b; // block of the current offset in idx->chunkstats
 };
 
 ti_conf_t ti_conf_null = { 0, 0, 0, 0, 0, 0, 0, '\t', DEFAULT_REGION_SPLIT_CHARACTER, '#', 0 };
@@ -123,6 +164,25 @@ static inline int ti_reg2bin(uint32_t beg, uint32_t end)
 	return 0;
 }
 
+static inline void init_keystat(ti_keystat_t *ks)
+{
+	memset(ks, 0, sizeof(ti_keystat_t));
+	ks->beg = ks->beg2 = INT32_MAX;
+	ks->end = ks->end2 = -1;
+}
+
+static inline void update_keystat(ti_keystat_t *ks, const ti_intv_t *intv, uint64_t off_beg, uint64_t off_end, int len)
+{
+	if (ks->n == 0) ks->off_beg = off_beg;
+	ks->off_end = off_end;
+	ks->n++;
+	ks->ulen += len + 1; // including the newline
+	if (intv->beg < ks->beg) ks->beg = intv->beg;
+	if (intv->end > ks->end) ks->end = intv->end;
+	if (intv->beg2 >= 0 && intv->beg2 < ks->beg2) ks->beg2 = intv->beg2;
+	if (intv->end2 > ks->end2) ks->end2 = intv->end2;
+}
+
 static int get_tid(ti_index_t *idx, const char *ss)
 {
 	khint_t k;
@@ -135,8 +195,10 @@ static int get_tid(ti_index_t *idx, const char *ss)
 			idx->max = idx->max? idx->max<<1 : 8;
 			idx->index = realloc(idx->index, idx->max * sizeof(void*));
 			idx->index2 = realloc(idx->index2, idx->max * sizeof(ti_lidx_t));
+			idx->keystats = realloc(idx->keystats, idx->max * sizeof(ti_keystat_t));
 		}
 		memset(&idx->index2[idx->n], 0, sizeof(ti_lidx_t));
+		init_keystat(&idx->keystats[idx->n]);
 		idx->index[idx->n++] = kh_init(i);
 		// update ->tname
 		tid = size = kh_size(idx->tname);
@@ -255,14 +317,14 @@ int ti_get_intv(const ti_conf_t *conf, int len, char *line, ti_interval_t *intv)
 }
 
 
-static int get_intv(ti_index_t *idx, kstring_t *str, ti_intv_t *intv)
+// resolve a line parsed by ti_get_intv (<parsed> is its return value) into tid, positions and bins
+static int get_intv_parsed(ti_index_t *idx, kstring_t *str, int parsed, ti_interval_t x, ti_intv_t *intv)
 {
-	ti_interval_t x;
         char *str_ptr;
         char sname_double[strlen(str->s)+1];
 	intv->tid = intv->beg = intv->end = intv->beg2 = intv->end2 = intv->bin = intv->bin2 =  -1;
         char region_split_character = idx->conf.region_split_character;
-	if (ti_get_intv(&idx->conf, str->l, str->s, &x) == 0) {
+	if (parsed == 0) {
 
 		char c = *x.se;
                 *x.se = '\0';
@@ -289,11 +351,17 @@ static int get_intv(ti_index_t *idx, kstring_t *str, ti_intv_t *intv)
 
 		return (intv->tid >= 0 && intv->beg >= 0 && intv->end >= 0 && ((!idx->conf.bc2 && !idx->conf.ec2) || (intv->beg2 >=0 && intv->end2 >=0))  )? 0 : -1;
 	} else {
-		fprintf(stderr, "[%s] the following line cannot be parsed and skipped: %s\n", __func__, str->s);
+		fprintf(stderr, "[get_intv] the following line cannot be parsed and skipped: %s\n", str->s);
 		return -1;
 	}
 }
 
+static int get_intv(ti_index_t *idx, kstring_t *str, ti_intv_t *intv)
+{
+	ti_interval_t x;
+	return get_intv_parsed(idx, str, ti_get_intv(&idx->conf, str->l, str->s, &x), x, intv);
+}
+
 /************
  * indexing *
  ************/
@@ -371,16 +439,145 @@ static void fill_missing(ti_index_t *idx)
 	}
 }
 
-ti_index_t *ti_index_core(BGZF *fp, const ti_conf_t *conf)
+/* per-block column statistics */
+
+static ti_chunkstats_t *chunkstats_init(const int *statcols, int nstatcols)
 {
-	int ret;
+	ti_chunkstats_t *cs;
+	int j;
+	cs = (ti_chunkstats_t*)calloc(1, sizeof(ti_chunkstats_t));
+	cs->ncols = nstatcols;
+	cs->col = (int32_t*)malloc(nstatcols * 4);
+	cs->ndict = (int32_t*)calloc(nstatcols, 4);
+	cs->dict = (char***)calloc(nstatcols, sizeof(char**));
+	for (j = 0; j < nstatcols; ++j) {
+		cs->col[j] = statcols[j];
+		cs->dict[j] = (char**)calloc(TI_CHUNKSTAT_MAX_DICT, sizeof(char*));
+	}
+	return cs;
+}
+
+static void ti_chunkstats_destroy(ti_chunkstats_t *cs)
+{
+	int j, k;
+	if (cs == 0) return;
+	for (j = 0; j < cs->ncols; ++j) {
+		if (cs->dict[j])
+			for (k = 0; k < cs->ndict[j]; ++k) free(cs->dict[j][k]);
+		free(cs->dict[j]);
+	}
+	free(cs->col); free(cs->ndict); free(cs->dict);
+	free(cs->coff); free(cs->first);
+	free(cs->min); free(cs->max); free(cs->bits);
+	free(cs);
+}
+
+// add the fields of a record starting at virtual offset off to the statistics of its block
+static void chunkstats_update(ti_chunkstats_t *cs, int *m, uint64_t off, const kstring_t *str, char delimiter)
+{
+	int i, j, k, b, col, p;
+	if (cs->nblocks == 0 || cs->coff[cs->nblocks-1] != off>>16) { // a new block
+		if (cs->nblocks == *m) {
+			*m = *m? *m<<1 : 256;
+			cs->coff = (uint64_t*)realloc(cs->coff, *m * 8);
+			cs->first = (uint64_t*)realloc(cs->first, *m * 8);
+			cs->min = (double*)realloc(cs->min, (size_t)*m * cs->ncols * sizeof(double));
+			cs->max = (double*)realloc(cs->max, (size_t)*m * cs->ncols * sizeof(double));
+			cs->bits = (uint64_t*)realloc(cs->bits, (size_t)*m * cs->ncols * 8);
+		}
+		b = cs->nblocks++;
+		cs->coff[b] = off>>16;
+		cs->first[b] = off;
+		for (j = 0; j < cs->ncols; ++j) {
+			cs->min[b*cs->ncols+j] = HUGE_VAL;
+			cs->max[b*cs->ncols+j] = -HUGE_VAL;
+			cs->bits[b*cs->ncols+j] = 0;
+		}
+	}
+	b = cs->nblocks - 1;
+	for (j = 0; j < cs->ncols; ++j) {
+		const char *field;
+		char *end = 0;
+		int len;
+		double x;
+		// find the field
+		for (i = p = col = 0; i < (int)str->l && col < cs->col[j]; ++i)
+			if (str->s[i] == delimiter) { ++col; p = i + 1; }
+		if (col < cs->col[j]) continue;
+		field = str->s + p;
+		for (len = 0; p + len < (int)str->l && field[len] != delimiter; ++len);
+		if (len > 0 && !isspace((unsigned char)*field) && (x = strtod(field, &end), end == field + len)) { // the whole field is a number
+			if (x < cs->min[b*cs->ncols+j]) cs->min[b*cs->ncols+j] = x;
+			if (x > cs->max[b*cs->ncols+j]) cs->max[b*cs->ncols+j] = x;
+		}
+		if (cs->ndict[j] < 0) continue; // too many distinct values
+		for (k = 0; k < cs->ndict[j]; ++k)
+			if (strncmp(cs->dict[j][k], field, len) == 0 && cs->dict[j][k][len] == 0) break;
+		if (k == cs->ndict[j]) {
+			if (k == TI_CHUNKSTAT_MAX_DICT) { // give up the value sets for this column
+				for (k = 0; k < cs->ndict[j]; ++k) free(cs->dict[j][k]);
+				free(cs->dict[j]); cs->dict[j] = 0;
+				cs->ndict[j] = -1;
+				continue;
+			}
+			cs->dict[j][k] = (char*)malloc(len + 1);
+			memcpy(cs->dict[j][k], field, len);
+			cs->dict[j][k][len] = 0;
+			cs->ndict[j]++;
+		}
+		cs->bits[b*cs->ncols+j] |= 1ULL<<k;
+	}
+}
+
+// record a line of <len> bytes between virtual offsets <beg> and <end>, after <lineno> lines, in the block offset table
+static void blocktable_add(ti_blocktable_t *bt, uint64_t beg, uint64_t end, int len, uint64_t lineno)
+{
+	if (bt->n == 0 || bt->voff[bt->n-1]>>16 != beg>>16) { // the first line starting in the block
+		if (bt->n == bt->m) {
+			bt->m = bt->m? bt->m<<1 : 256;
+			bt->voff = (uint64_t*)realloc(bt->voff, bt->m * 8);
+			bt->uoff = (uint64_t*)realloc(bt->uoff, bt->m * 8);
+			bt->line = (uint64_t*)realloc(bt->line, bt->m * 8);
+		}
+		bt->voff[bt->n] = beg;
+		bt->uoff[bt->n] = bt->ulen;
+		bt->line[bt->n++] = lineno;
+	}
+	bt->ulen += len + 1;
+	bt->voff_end = end;
+}
+
+static void ti_blocktable_destroy(ti_blocktable_t *bt)
+{
+	if (bt == 0) return;
+	free(bt->voff); free(bt->uoff); free(bt->line);
+	free(bt);
+}
+
+struct __ti_indexer_t {
 	ti_index_t *idx;
 	uint32_t last_bin, save_bin;
 	int32_t last_coor, last_tid, save_tid;
-	uint64_t save_off, last_off, lineno = 0, offset0 = (uint64_t)-1, tmp;
-	kstring_t *str;
+	uint64_t save_off, lineno, offset0;
+	int m_blocks;
+};
 
-	str = calloc(1, sizeof(kstring_t));
+// an indexer adding lines to <idx>, the first one at virtual offset <off>
+static ti_indexer_t *indexer_new(ti_index_t *idx, uint64_t off)
+{
+	ti_indexer_t *ix;
+	ix = (ti_indexer_t*)calloc(1, sizeof(ti_indexer_t));
+	ix->idx = idx;
+	ix->save_bin = ix->last_bin = 0xffffffffu;
+	ix->save_tid = ix->last_tid = -1;
+	ix->save_off = off; ix->last_coor = -1;
+	ix->offset0 = (uint64_t)-1;
+	return ix;
+}
+
+ti_indexer_t *ti_indexer_init(const ti_conf_t *conf, const int *statcols, int nstatcols, uint64_t off0)
+{
+	ti_index_t *idx;
 
 	idx = (ti_index_t*)calloc(1, sizeof(ti_index_t));
 	idx->conf = *conf;
@@ -388,64 +585,274 @@ ti_index_t *ti_index_core(BGZF *fp, const ti_conf_t *conf)
 	idx->tname = kh_init(s);
 	idx->index = 0;
 	idx->index2 = 0;
+	idx->keystats = 0;
         idx->linecount=0;
-
-	save_bin = save_tid = last_tid = last_bin = 0xffffffffu;
-	save_off = last_off = bgzf_tell(fp); last_coor = 0xffffffffu;
-	while ((ret = ti_readline(fp, str)) >= 0) {
-                idx->linecount++;
-		ti_intv_t intv;
-		++lineno;
-		if (lineno <= idx->conf.line_skip || str->s[0] == idx->conf.meta_char) {
-			last_off = bgzf_tell(fp);
-			continue;
-		}
-		get_intv(idx, str, &intv);
-                if ( intv.beg<0 || intv.end<0 )
-                {
-                    fprintf(stderr,"[ti_index_core] the indexes overlap or are out of bounds\n");
-                    return(NULL);
-                }
-		if (last_tid != intv.tid) { // change of chromosomes
-                if (last_tid>intv.tid )
-                {
-                    fprintf(stderr,"[ti_index_core] the chromosome blocks not continuous at line %llu, is the file sorted? [pos %d]\n",(unsigned long long)lineno,intv.beg+1);
-                    return(NULL);
-                }
-		    last_tid = intv.tid;
-		    last_bin = 0xffffffffu;
-		} else if (last_coor > intv.beg) {
-		    fprintf(stderr, "[ti_index_core] the file out of order at line %llu\n", (unsigned long long)lineno);
-		    return(NULL);
-		}
-		tmp = insert_offset2(&idx->index2[intv.tid], intv.beg, intv.end, last_off);
-		if (last_off == 0) offset0 = tmp;
-		if (intv.bin != last_bin) { // then possibly write the binning index
-			if (save_bin != 0xffffffffu) // save_bin==0xffffffffu only happens to the first record
-				insert_offset(idx->index[save_tid], save_bin, save_off, last_off);
-			save_off = last_off;
-			save_bin = last_bin = intv.bin;
-			save_tid = intv.tid;
-			if (save_tid < 0) break;
-		}
-		if (bgzf_tell(fp) <= last_off) {
-			fprintf(stderr, "[ti_index_core] bug in BGZF: %llx < %llx\n",
-					(unsigned long long)bgzf_tell(fp), (unsigned long long)last_off);
-			return(NULL);
-		}
-		last_off = bgzf_tell(fp);
-		last_coor = intv.beg;
+	if (nstatcols > 0) idx->chunkstats = chunkstats_init(statcols, nstatcols);
+	idx->blocks = (ti_blocktable_t*)calloc(1, sizeof(ti_blocktable_t));
+	return indexer_new(idx, off0);
+}
+
+// add a line; <x> is the result of ti_get_intv on the line if it has already been parsed (NULL otherwise)
+static int indexer_add(ti_indexer_t *ix, kstring_t *str, uint64_t beg, uint64_t end, int parsed, const ti_interval_t *x)
+{
+	ti_index_t *idx = ix->idx;
+	ti_intv_t intv;
+	uint64_t tmp;
+
+	if (idx->blocks) blocktable_add(idx->blocks, beg, end, str->l, idx->linecount);
+        idx->linecount++;
+	++ix->lineno;
+	if (ix->lineno <= idx->conf.line_skip || str->s[0] == idx->conf.meta_char) return 0;
+	if (x) get_intv_parsed(idx, str, parsed, *x, &intv);
+	else get_intv(idx, str, &intv);
+        if ( intv.beg<0 || intv.end<0 )
+        {
+            fprintf(stderr,"[ti_index_core] the indexes overlap or are out of bounds\n");
+            return -1;
+        }
+	if (ix->last_tid != intv.tid) { // change of chromosomes
+            if (ix->last_tid>intv.tid )
+            {
+                fprintf(stderr,"[ti_index_core] the chromosome blocks not continuous at line %llu, is the file sorted? [pos %d]\n",(unsigned long long)ix->lineno,intv.beg+1);
+                return -1;
+            }
+	    ix->last_tid = intv.tid;
+	    ix->last_bin = 0xffffffffu;
+	} else if (ix->last_coor > intv.beg) {
+	    fprintf(stderr, "[ti_index_core] the file out of order at line %llu\n", (unsigned long long)ix->lineno);
+	    return -1;
+	}
+	tmp = insert_offset2(&idx->index2[intv.tid], intv.beg, intv.end, beg);
+	if (beg == 0) ix->offset0 = tmp;
+	if (intv.bin != ix->last_bin) { // then possibly write the binning index
+		if (ix->save_bin != 0xffffffffu) // save_bin==0xffffffffu only happens to the first record
+			insert_offset(idx->index[ix->save_tid], ix->save_bin, ix->save_off, beg);
+		ix->save_off = beg;
+		ix->save_bin = ix->last_bin = intv.bin;
+		ix->save_tid = intv.tid;
+		if (ix->save_tid < 0) return 1;
+	}
+	if (end <= beg) {
+		fprintf(stderr, "[ti_index_core] bug in BGZF: %llx < %llx\n",
+				(unsigned long long)end, (unsigned long long)beg);
+		return -1;
 	}
-	if (save_tid >= 0) insert_offset(idx->index[save_tid], save_bin, save_off, bgzf_tell(fp));
+	update_keystat(&idx->keystats[intv.tid], &intv, beg, end, str->l);
+	if (idx->chunkstats) chunkstats_update(idx->chunkstats, &ix->m_blocks, beg, str, idx->conf.delimiter);
+	ix->last_coor = intv.beg;
+	return 0;
+}
+
+int ti_indexer_add(ti_indexer_t *ix, kstring_t *str, uint64_t beg, uint64_t end)
+{
+	return indexer_add(ix, str, beg, end, 0, 0);
+}
+
+ti_index_t *ti_indexer_finish(ti_indexer_t *ix, uint64_t end)
+{
+	ti_index_t *idx = ix->idx;
+	if (ix->save_tid >= 0) insert_offset(idx->index[ix->save_tid], ix->save_bin, ix->save_off, end);
 	merge_chunks(idx);
 	fill_missing(idx);
-	if (offset0 != (uint64_t)-1 && idx->n && idx->index2[0].offset) {
-		int i, beg = offset0>>32, end = offset0&0xffffffffu;
+	if (ix->offset0 != (uint64_t)-1 && idx->n && idx->index2[0].offset) {
+		int i, beg = ix->offset0>>32, end = ix->offset0&0xffffffffu;
 		for (i = beg; i <= end; ++i) idx->index2[0].offset[i] = 0;
 	}
+	free(ix);
+	return idx;
+}
+
+void ti_indexer_destroy(ti_indexer_t *ix)
+{
+	if (ix == 0) return;
+	ti_index_destroy(ix->idx);
+	free(ix);
+}
+
+ti_index_t *ti_index_core(BGZF *fp, const ti_conf_t *conf, const int *statcols, int nstatcols)
+{
+	int ret = 0;
+	ti_indexer_t *ix;
+	uint64_t off;
+	kstring_t *str;
 
+	str = calloc(1, sizeof(kstring_t));
+	off = bgzf_tell(fp);
+	ix = ti_indexer_init(conf, statcols, nstatcols, off);
+	while (ti_readline(fp, str) >= 0) {
+		if ((ret = ti_indexer_add(ix, str, off, bgzf_tell(fp))) != 0) break;
+		off = bgzf_tell(fp);
+	}
 	free(str->s); free(str);
-	return idx;
+	if (ret < 0) {
+		ti_indexer_destroy(ix);
+		return NULL;
+	}
+	return ti_indexer_finish(ix, bgzf_tell(fp));
+}
+
+/*****************************
+ * multi-threaded index core *
+ *****************************/
+
+#define MT_BLOCKS_PER_THREAD 128
+
+// a line read by a worker. The first line of a worker (cand) may have started in an earlier range.
+typedef struct {
+	uint64_t beg, end;
+	int64_t s;
+	int len, cand, parsed;
+	ti_interval_t x;
+} mt_line_t;
+
+typedef struct {
+	BGZF *fp;
+	const ti_conf_t *conf;
+	const int64_t *addr;  // block addresses of the round; addr[b1] is the address after the last block of the range
+	int b0, b1;
+	kstring_t text;       // the lines, each terminated by a NUL
+	mt_line_t *lines;
+	int n, m, error;
+	int started;          // run on its own thread (to be joined)
+} mt_worker_t;
+
+static void mt_push(mt_worker_t *w, uint64_t beg, int cand)
+{
+	mt_line_t *l;
+	if (w->n == w->m) {
+		w->m = w->m? w->m<<1 : 1024;
+		w->lines = (mt_line_t*)realloc(w->lines, w->m * sizeof(mt_line_t));
+	}
+	l = w->lines + w->n++;
+	l->beg = beg; l->s = w->text.l; l->cand = cand;
+}
+
+// read the lines starting in blocks [b0, b1) (and the end of the last one), the line running into b0 included
+// as a candidate, then parse them. A line ends at the next block's address if its newline ends a block, as
+// bgzf_tell() reports after bgzf_getline().
+static void *mt_worker(void *data)
+{
+	mt_worker_t *w = (mt_worker_t*)data;
+	uint8_t *buf = (uint8_t*)w->fp->uncompressed_block;
+	int64_t addr = w->addr[w->b0], next;
+	int b = w->b0, o = 0, i, open = 1;
+	mt_push(w, (uint64_t)addr << 16, 1);
+	while (open) {
+		if ((next = bgzf_load_block(w->fp, addr)) < 0) { w->error = 1; break; }
+		if (w->fp->block_length == 0) { // end of the data : the last line has no newline
+			if (w->lines[w->n-1].s == (int64_t)w->text.l) w->n--; // nothing after the last newline
+			else {
+				w->lines[w->n-1].end = (uint64_t)addr << 16;
+				w->lines[w->n-1].len = w->text.l - w->lines[w->n-1].s;
+				w->text.l++; // keep the NUL written by kputsn
+			}
+			break;
+		}
+		for (o = 0; o < w->fp->block_length && open;) {
+			uint8_t *p = memchr(buf + o, '\n', w->fp->block_length - o);
+			int e = p? p - buf : w->fp->block_length;
+			mt_line_t *l = w->lines + w->n - 1;
+			kputsn((char*)buf + o, e - o, &w->text);
+			if (!p) break;
+			w->text.l++; // keep the NUL written by kputsn
+			l->len = w->text.l - 1 - l->s;
+			l->end = e + 1 < w->fp->block_length? (uint64_t)addr << 16 | (e + 1) : (uint64_t)next << 16;
+			o = e + 1;
+			if (o < w->fp->block_length && b < w->b1) mt_push(w, (uint64_t)addr << 16 | o, 0);
+			else if (o == w->fp->block_length && b + 1 < w->b1) mt_push(w, (uint64_t)next << 16, 0);
+			else open = 0;
+		}
+		addr = next; ++b;
+	}
+	for (i = 0; i < w->n; ++i) {
+		mt_line_t *l = w->lines + i;
+		l->parsed = ti_get_intv(w->conf, l->len, w->text.s + l->s, &l->x);
+	}
+	return 0;
+}
+
+// start the workers on the next blocks, up to the first empty block (the end of the data for bgzf_getline()).
+// *a is the address of the next block. Returns the number of workers started.
+static int mt_start(BGZF *fp, int64_t *a, int64_t *addr, int *done, mt_worker_t *w, pthread_t *tid, int n_threads)
+{
+	int nb, nw, k, usize, size;
+	for (nb = 0; nb < n_threads * MT_BLOCKS_PER_THREAD; ++nb) {
+		if ((size = bgzf_block_info(fp, *a, &usize)) <= 0 || usize == 0) { *done = 1; break; }
+		addr[nb] = *a; *a += size;
+	}
+	addr[nb] = *a;
+	k = (nb + n_threads - 1) / n_threads;
+	for (nw = 0; nw * k < nb; ++nw) {
+		w[nw].addr = addr;
+		w[nw].b0 = nw * k;
+		w[nw].b1 = w[nw].b0 + k < nb? w[nw].b0 + k : nb;
+		w[nw].n = 0; w[nw].text.l = 0;
+		w[nw].started = pthread_create(&tid[nw], 0, mt_worker, w + nw) == 0;
+		if (!w[nw].started) mt_worker(w + nw); // no thread left: parse the range in this one
+	}
+	return nw;
+}
+
+// index the lines of the workers in file order. A candidate is a line only if the previous line ends where it starts.
+static int mt_merge(ti_indexer_t *ix, mt_worker_t *w, int nw, uint64_t *next_beg)
+{
+	int i, j, ret = 0;
+	for (i = 0; i < nw && ret == 0; ++i) {
+		if (w[i].error) ret = -1;
+		for (j = 0; j < w[i].n && ret == 0; ++j) {
+			mt_line_t *l = w[i].lines + j;
+			kstring_t str;
+			if (l->cand && l->beg != *next_beg) continue;
+			str.l = l->len; str.m = l->len + 1; str.s = w[i].text.s + l->s;
+			ret = indexer_add(ix, &str, l->beg, l->end, l->parsed, &l->x);
+			*next_beg = l->end;
+		}
+	}
+	return ret;
+}
+
+// same index as ti_index_core. Blocks are read in rounds: <n_threads> workers decompress, split and parse the
+// lines of a round while the lines of the previous round are indexed.
+static ti_index_t *ti_index_core_mt(const char *fn, const ti_conf_t *conf, const int *statcols, int nstatcols, int n_threads)
+{
+	mt_worker_t *w;
+	pthread_t *tid;
+	BGZF *fp;
+	ti_indexer_t *ix;
+	int64_t *addr, a = 0;
+	uint64_t next_beg = 0;
+	int i, r, nw, nprev = 0, ret = 0, done = 0, nbuf = n_threads * MT_BLOCKS_PER_THREAD + 1;
+
+	if ((fp = bgzf_open(fn, "r")) == 0) return 0;
+	w = (mt_worker_t*)calloc(2 * n_threads, sizeof(mt_worker_t));
+	tid = (pthread_t*)calloc(2 * n_threads, sizeof(pthread_t));
+	addr = (int64_t*)malloc(2 * nbuf * sizeof(int64_t));
+	for (i = 0; i < 2 * n_threads; ++i) {
+		if ((w[i].fp = bgzf_open(fn, "r")) == 0) ret = -1;
+		w[i].conf = conf;
+	}
+	ix = ti_indexer_init(conf, statcols, nstatcols, 0);
+	for (r = 0; ; ++r) {
+		int cur = r & 1, prev = cur ^ 1;
+		nw = !done && ret == 0? mt_start(fp, &a, addr + cur * nbuf, &done, w + cur * n_threads, tid + cur * n_threads, n_threads) : 0;
+		if (nprev && ret == 0) ret = mt_merge(ix, w + prev * n_threads, nprev, &next_beg);
+		for (i = 0; i < nw; ++i)
+			if (w[cur * n_threads + i].started) pthread_join(tid[cur * n_threads + i], 0);
+		if (nw == 0) break;
+		nprev = nw;
+	}
+	for (i = 0; i < 2 * n_threads; ++i) {
+		if (w[i].fp) bgzf_close(w[i].fp);
+		free(w[i].text.s); free(w[i].lines);
+	}
+	free(w); free(tid); free(addr);
+	bgzf_close(fp);
+	if (ret < 0) {
+		ti_indexer_destroy(ix);
+		return NULL;
+	}
+	// the end of the data, or the end of the line that stopped the indexing
+	return ti_indexer_finish(ix, ret == 0? (uint64_t)a << 16 : next_beg);
 }
 
 void ti_index_destroy(ti_index_t *idx)
@@ -473,6 +880,25 @@ void ti_index_destroy(ti_index_t *idx)
 	free(idx->index);
 	// destroy the linear index
 	free(idx->index2);
+	free(idx->keystats);
+	ti_chunkstats_destroy(idx->chunkstats);
+	ti_blocktable_destroy(idx->blocks);
+	if (idx->reads) {
+		free(idx->reads->a);
+		free(idx->reads);
+	}
+	// destroy the mate chromosome maps
+	for (i = 0; i < 2; ++i) {
+		ti_matemap_t *mm = idx->matemap + i;
+		int j;
+		if (mm->h == 0) continue;
+		for (j = 0; j < mm->n; ++j) {
+			free(mm->names[j]);
+			free(mm->tids[j].tid);
+		}
+		free(mm->names); free(mm->tids);
+		kh_destroy(s, mm->h);
+	}
 	free(idx);
 }
 
@@ -480,6 +906,289 @@ void ti_index_destroy(ti_index_t *idx)
  * index file I/O *
  ******************/
 
+static inline void write_u32(BGZF *fp, uint32_t x, int ti_is_be)
+{
+	if (ti_is_be) bam_swap_endian_4p(&x);
+	bgzf_write(fp, &x, 4);
+}
+
+static inline void write_u64(BGZF *fp, uint64_t x, int ti_is_be)
+{
+	if (ti_is_be) bam_swap_endian_8p(&x);
+	bgzf_write(fp, &x, 8);
+}
+
+static inline uint32_t read_u32(BGZF *fp, int ti_is_be)
+{
+	uint32_t x = 0;
+	bgzf_read(fp, &x, 4);
+	return ti_is_be? bam_swap_endian_4(x) : x;
+}
+
+static inline uint64_t read_u64(BGZF *fp, int ti_is_be)
+{
+	uint64_t x = 0;
+	bgzf_read(fp, &x, 8);
+	return ti_is_be? bam_swap_endian_8(x) : x;
+}
+
+// same as read_u32/read_u64, but return -1 if the file ends before the value
+static inline int read_u32_checked(BGZF *fp, int ti_is_be, uint32_t *x)
+{
+	if (bgzf_read(fp, x, 4) != 4) return -1;
+	if (ti_is_be) *x = bam_swap_endian_4(*x);
+	return 0;
+}
+
+static inline int read_u64_checked(BGZF *fp, int ti_is_be, uint64_t *x)
+{
+	if (bgzf_read(fp, x, 8) != 8) return -1;
+	if (ti_is_be) *x = bam_swap_endian_8(*x);
+	return 0;
+}
+
+static void write_ext_header(BGZF *fp, const char *tag, uint64_t len, int ti_is_be)
+{
+	bgzf_write(fp, tag, 4);
+	write_u64(fp, len, ti_is_be);
+}
+
+// write the optional sections that follow the linear indices
+static void ti_index_save_ext(const ti_index_t *idx, BGZF *fp, int ti_is_be)
+{
+	int i;
+	if (idx->keystats) {
+		write_ext_header(fp, EXT_TAG_KEYSTATS, (uint64_t)KEYSTAT_RECORD_SIZE * idx->n, ti_is_be);
+		for (i = 0; i < idx->n; ++i) {
+			const ti_keystat_t *ks = idx->keystats + i;
+			write_u64(fp, ks->n, ti_is_be);
+			write_u32(fp, ks->beg, ti_is_be); write_u32(fp, ks->end, ti_is_be);
+			write_u32(fp, ks->beg2, ti_is_be); write_u32(fp, ks->end2, ti_is_be);
+			write_u64(fp, ks->off_beg, ti_is_be); write_u64(fp, ks->off_end, ti_is_be);
+			write_u64(fp, ks->ulen, ti_is_be);
+		}
+	}
+	if (idx->chunkstats) {
+		const ti_chunkstats_t *cs = idx->chunkstats;
+		uint64_t len = 8 + (uint64_t)cs->nblocks * (16 + 24 * cs->ncols);
+		int b, j, k;
+		for (j = 0; j < cs->ncols; ++j) {
+			len += 8;
+			for (k = 0; k < cs->ndict[j]; ++k) len += 4 + strlen(cs->dict[j][k]);
+		}
+		write_ext_header(fp, EXT_TAG_CHUNKSTATS, len, ti_is_be);
+		write_u32(fp, cs->ncols, ti_is_be);
+		write_u32(fp, cs->nblocks, ti_is_be);
+		for (j = 0; j < cs->ncols; ++j) {
+			write_u32(fp, cs->col[j], ti_is_be);
+			write_u32(fp, cs->ndict[j], ti_is_be);
+			for (k = 0; k < cs->ndict[j]; ++k) {
+				write_u32(fp, strlen(cs->dict[j][k]), ti_is_be);
+				bgzf_write(fp, cs->dict[j][k], strlen(cs->dict[j][k]));
+			}
+		}
+		for (b = 0; b < cs->nblocks; ++b) {
+			write_u64(fp, cs->coff[b], ti_is_be);
+			write_u64(fp, cs->first[b], ti_is_be);
+			for (j = 0; j < cs->ncols; ++j) {
+				union { double d; uint64_t u; } x;
+				x.d = cs->min[b*cs->ncols+j]; write_u64(fp, x.u, ti_is_be);
+				x.d = cs->max[b*cs->ncols+j]; write_u64(fp, x.u, ti_is_be);
+				write_u64(fp, cs->bits[b*cs->ncols+j], ti_is_be);
+			}
+		}
+	}
+	if (idx->blocks) {
+		const ti_blocktable_t *bt = idx->blocks;
+		int64_t b;
+		write_ext_header(fp, EXT_TAG_BLOCKTABLE, 24 + (uint64_t)bt->n * 24, ti_is_be);
+		write_u64(fp, bt->n, ti_is_be);
+		write_u64(fp, bt->ulen, ti_is_be);
+		write_u64(fp, bt->voff_end, ti_is_be);
+		for (b = 0; b < bt->n; ++b) {
+			write_u64(fp, bt->voff[b], ti_is_be);
+			write_u64(fp, bt->uoff[b], ti_is_be);
+			write_u64(fp, bt->line[b], ti_is_be);
+		}
+	}
+	if (idx->reads) {
+		const ti_readindex_t *ri = idx->reads;
+		int64_t k;
+		write_ext_header(fp, EXT_TAG_READINDEX, 12 + (uint64_t)ri->n * 8, ti_is_be);
+		write_u32(fp, ri->col, ti_is_be);
+		write_u64(fp, ri->n, ti_is_be);
+		for (k = 0; k < ri->n; ++k) write_u64(fp, ri->a[k], ti_is_be);
+	}
+}
+
+// read the chunk statistics section; returns 0 on success
+static int ti_chunkstats_load(ti_index_t *idx, BGZF *fp, int ti_is_be)
+{
+	ti_chunkstats_t *cs;
+	uint32_t u32[2];
+	int b, j, k;
+	if (read_u32_checked(fp, ti_is_be, &u32[0]) != 0 || read_u32_checked(fp, ti_is_be, &u32[1]) != 0) return -1;
+	if ((int32_t)u32[0] < 0 || (int32_t)u32[1] < 0) return -1;
+	cs = (ti_chunkstats_t*)calloc(1, sizeof(ti_chunkstats_t));
+	cs->ncols = u32[0];
+	cs->nblocks = u32[1];
+	cs->col = (int32_t*)calloc(cs->ncols, 4);
+	cs->ndict = (int32_t*)calloc(cs->ncols, 4);
+	cs->dict = (char***)calloc(cs->ncols, sizeof(char**));
+	for (j = 0; j < cs->ncols; ++j) {
+		if (read_u32_checked(fp, ti_is_be, &u32[0]) != 0 || read_u32_checked(fp, ti_is_be, &u32[1]) != 0) { ti_chunkstats_destroy(cs); return -1; }
+		if ((int32_t)u32[1] > TI_CHUNKSTAT_MAX_DICT) { ti_chunkstats_destroy(cs); return -1; }
+		cs->col[j] = u32[0];
+		cs->ndict[j] = u32[1];
+		if (cs->ndict[j] < 0) continue;
+		cs->dict[j] = (char**)calloc(TI_CHUNKSTAT_MAX_DICT, sizeof(char*));
+		for (k = 0; k < cs->ndict[j]; ++k) {
+			uint32_t l;
+			if (read_u32_checked(fp, ti_is_be, &l) != 0 || (int32_t)l < 0) { cs->ndict[j] = k; ti_chunkstats_destroy(cs); return -1; }
+			cs->dict[j][k] = (char*)calloc(l + 1, 1);
+			if (bgzf_read(fp, cs->dict[j][k], l) != (int)l) { cs->ndict[j] = k + 1; ti_chunkstats_destroy(cs); return -1; }
+		}
+	}
+	cs->coff = (uint64_t*)malloc((size_t)cs->nblocks * 8);
+	cs->first = (uint64_t*)malloc((size_t)cs->nblocks * 8);
+	cs->min = (double*)malloc((size_t)cs->nblocks * cs->ncols * sizeof(double));
+	cs->max = (double*)malloc((size_t)cs->nblocks * cs->ncols * sizeof(double));
+	cs->bits = (uint64_t*)malloc((size_t)cs->nblocks * cs->ncols * 8);
+	for (b = 0; b < cs->nblocks; ++b) {
+		if (read_u64_checked(fp, ti_is_be, &cs->coff[b]) != 0 || read_u64_checked(fp, ti_is_be, &cs->first[b]) != 0) { ti_chunkstats_destroy(cs); return -1; }
+		for (j = 0; j < cs->ncols; ++j) {
+			union { double d; uint64_t u; } x[2];
+			if (read_u64_checked(fp, ti_is_be, &x[0].u) != 0 || read_u64_checked(fp, ti_is_be, &x[1].u) != 0
+				|| read_u64_checked(fp, ti_is_be, &cs->bits[b*cs->ncols+j]) != 0) { ti_chunkstats_destroy(cs); return -1; }
+			cs->min[b*cs->ncols+j] = x[0].d;
+			cs->max[b*cs->ncols+j] = x[1].d;
+		}
+	}
+	idx->chunkstats = cs;
+	return 0;
+}
+
+// read the block offset table section of <len> bytes; returns 0 on success
+static int ti_blocktable_load(ti_index_t *idx, BGZF *fp, uint64_t len, int ti_is_be)
+{
+	ti_blocktable_t *bt;
+	int64_t b;
+	bt = (ti_blocktable_t*)calloc(1, sizeof(ti_blocktable_t));
+	bt->n = bt->m = read_u64(fp, ti_is_be);
+	bt->ulen = read_u64(fp, ti_is_be);
+	bt->voff_end = read_u64(fp, ti_is_be);
+	if (bt->n < 0 || len != 24 + (uint64_t)bt->n * 24) { free(bt); return -1; }
+	bt->voff = (uint64_t*)malloc(bt->n * 8);
+	bt->uoff = (uint64_t*)malloc(bt->n * 8);
+	bt->line = (uint64_t*)malloc(bt->n * 8);
+	for (b = 0; b < bt->n; ++b) {
+		bt->voff[b] = read_u64(fp, ti_is_be);
+		bt->uoff[b] = read_u64(fp, ti_is_be);
+		bt->line[b] = read_u64(fp, ti_is_be);
+	}
+	idx->blocks = bt;
+	return 0;
+}
+
+// read the read name index section of <len> bytes; returns 0 on success
+static int ti_readindex_load(ti_index_t *idx, BGZF *fp, uint64_t len, int ti_is_be)
+{
+	ti_readindex_t *ri;
+	int64_t k;
+	ri = (ti_readindex_t*)calloc(1, sizeof(ti_readindex_t));
+	ri->col = read_u32(fp, ti_is_be);
+	ri->n = ri->m = read_u64(fp, ti_is_be);
+	if (ri->col < 0 || ri->n < 0 || len != 12 + (uint64_t)ri->n * 8) { free(ri); return -1; }
+	ri->a = (uint64_t*)malloc((ri->n? ri->n : 1) * 8);
+	for (k = 0; k < ri->n; ++k) ri->a[k] = read_u64(fp, ti_is_be);
+	idx->reads = ri;
+	return 0;
+}
+
+// read the optional sections, skipping the ones that are unknown or malformed
+static void ti_index_load_ext(ti_index_t *idx, BGZF *fp, int ti_is_be)
+{
+	char tag[4];
+	uint64_t len;
+	int i;
+	while (bgzf_read(fp, tag, 4) == 4) {
+		len = read_u64(fp, ti_is_be);
+		if (memcmp(tag, EXT_TAG_KEYSTATS, 4) == 0 && len == (uint64_t)KEYSTAT_RECORD_SIZE * idx->n) {
+			idx->keystats = (ti_keystat_t*)calloc(idx->n, sizeof(ti_keystat_t));
+			for (i = 0; i < idx->n; ++i) {
+				ti_keystat_t *ks = idx->keystats + i;
+				ks->n = read_u64(fp, ti_is_be);
+				ks->beg = read_u32(fp, ti_is_be); ks->end = read_u32(fp, ti_is_be);
+				ks->beg2 = read_u32(fp, ti_is_be); ks->end2 = read_u32(fp, ti_is_be);
+				ks->off_beg = read_u64(fp, ti_is_be); ks->off_end = read_u64(fp, ti_is_be);
+				ks->ulen = read_u64(fp, ti_is_be);
+			}
+		} else if (memcmp(tag, EXT_TAG_CHUNKSTATS, 4) == 0) {
+			if (ti_chunkstats_load(idx, fp, ti_is_be) != 0) return;
+		} else if (memcmp(tag, EXT_TAG_BLOCKTABLE, 4) == 0 && len >= 24) {
+			if (ti_blocktable_load(idx, fp, len, ti_is_be) != 0) return;
+		} else if (memcmp(tag, EXT_TAG_READINDEX, 4) == 0 && len >= 12) {
+			if (ti_readindex_load(idx, fp, len, ti_is_be) != 0) return;
+		} else { // unknown section
+			char buf[4096];
+			while (len > 0) {
+				int l = len < sizeof(buf)? (int)len : sizeof(buf);
+				if (bgzf_read(fp, buf, l) != l) return;
+				len -= l;
+			}
+		}
+	}
+}
+
+static void matemap_add(ti_matemap_t *mm, const char *chr, int len, int tid, kstring_t *str)
+{
+	ti_tidlist_t *p;
+	khint_t k;
+	int ret;
+	str->l = 0;
+	kputsn(chr, len, str);
+	k = kh_put(s, mm->h, str->s, &ret);
+	if (ret) { // a new chromosome; the key is owned by names
+		if (mm->n == mm->m) {
+			mm->m = mm->m? mm->m<<1 : 16;
+			mm->names = (char**)realloc(mm->names, mm->m * sizeof(char*));
+			mm->tids = (ti_tidlist_t*)realloc(mm->tids, mm->m * sizeof(ti_tidlist_t));
+		}
+		kh_key(mm->h, k) = mm->names[mm->n] = strdup(str->s);
+		memset(mm->tids + mm->n, 0, sizeof(ti_tidlist_t));
+		kh_value(mm->h, k) = mm->n++;
+	}
+	p = mm->tids + kh_value(mm->h, k);
+	if (p->n == p->m) {
+		p->m = p->m? p->m<<1 : 4;
+		p->tid = (int*)realloc(p->tid, p->m * sizeof(int));
+	}
+	p->tid[p->n++] = tid;
+}
+
+// split the chromosome pairs into mate1 and mate2 chromosome maps. tid lists are in increasing order.
+// for a 1D index, the sequence names go to the mate1 map.
+static void ti_build_matemaps(ti_index_t *idx)
+{
+	const char **names;
+	kstring_t str = {0, 0, 0};
+	int i, n;
+	names = ti_seqname(idx, &n);
+	idx->matemap[0].h = kh_init(s);
+	idx->matemap[1].h = kh_init(s);
+	for (i = 0; i < n; ++i) {
+		const char *sp = strchr(names[i], idx->conf.region_split_character);
+		if (sp == 0) {
+			matemap_add(idx->matemap, names[i], strlen(names[i]), i, &str);
+			continue;
+		}
+		matemap_add(idx->matemap, names[i], sp - names[i], i, &str);
+		matemap_add(idx->matemap + 1, sp + 1, strlen(sp + 1), i, &str);
+	}
+	free(str.s);
+	free(names);
+}
+
 void ti_index_save(const ti_index_t *idx, BGZF *fp)
 {
 	int32_t i, size, ti_is_be;
@@ -561,6 +1270,7 @@ void ti_index_save(const ti_index_t *idx, BGZF *fp)
 				bam_swap_endian_8p(&index2->offset[x]);
 		} else bgzf_write(fp, index2->offset, 8 * index2->n);
 	}
+	ti_index_save_ext(idx, fp, ti_is_be);
 }
 
 static ti_index_t *ti_index_load_core(BGZF *fp)
@@ -671,137 +1381,1184 @@ static ti_index_t *ti_index_load_core(BGZF *fp)
 		if (ti_is_be)
 			for (j = 0; j < index2->n; ++j) bam_swap_endian_8p(&index2->offset[j]);
 	}
-	return idx;
+	ti_index_load_ext(idx, fp, ti_is_be);
+	ti_build_matemaps(idx);
+	return idx;
+}
+
+ti_index_t *ti_index_load_local(const char *fnidx)
+{
+	BGZF *fp;
+	fp = bgzf_open(fnidx, "r");
+	if (fp) {
+		ti_index_t *idx = ti_index_load_core(fp);
+		bgzf_close(fp);
+		return idx;
+	} else return 0;
+}
+
+#ifdef _USE_KNETFILE
+static void download_from_remote(const char *url)
+{
+	const int buf_size = 1 * 1024 * 1024;
+	char *fn;
+	FILE *fp;
+	uint8_t *buf;
+	knetFile *fp_remote;
+	int l;
+	if (strstr(url, "ftp://") != url && strstr(url, "http://") != url) return;
+	l = strlen(url);
+	for (fn = (char*)url + l - 1; fn >= url; --fn)
+		if (*fn == '/') break;
+	++fn; // fn now points to the file name
+	fp_remote = knet_open(url, "r");
+	if (fp_remote == 0) {
+		fprintf(stderr, "[download_from_remote] fail to open remote file.\n");
+		return;
+	}
+	if ((fp = fopen(fn, "w")) == 0) {
+		fprintf(stderr, "[download_from_remote] fail to create file in the working directory.\n");
+		knet_close(fp_remote);
+		return;
+	}
+	buf = (uint8_t*)calloc(buf_size, 1);
+	while ((l = knet_read(fp_remote, buf, buf_size)) != 0)
+		fwrite(buf, 1, l, fp);
+	free(buf);
+	fclose(fp);
+	knet_close(fp_remote);
+}
+#else
+static void download_from_remote(const char *url)
+{
+	return;
+}
+#endif
+
+static char *get_local_version(const char *fn)
+{
+        struct stat sbuf;
+	char *fnidx = (char*)calloc(strlen(fn) + 5, 1);
+	strcat(strcpy(fnidx, fn), ".px2");
+	if ((strstr(fnidx, "ftp://") == fnidx || strstr(fnidx, "http://") == fnidx)) {
+		char *p, *url;
+		int l = strlen(fnidx);
+		for (p = fnidx + l - 1; p >= fnidx; --p)
+			if (*p == '/') break;
+		url = fnidx; fnidx = strdup(p + 1);
+		if (stat(fnidx, &sbuf) == 0) {
+			free(url);
+			return fnidx;
+		}
+		fprintf(stderr, "[%s] downloading the index file...\n", __func__);
+		download_from_remote(url);
+		free(url);
+	}
+        if (stat(fnidx, &sbuf) == 0) return fnidx;
+	free(fnidx);
+        return 0;
+}
+
+const char **ti_seqname(const ti_index_t *idx, int *n)
+{
+	const char **names;
+	khint_t k;
+	*n = idx->n;
+	names = calloc(idx->n, sizeof(void*));
+	for (k = kh_begin(idx->tname); k < kh_end(idx->tname); ++k)
+		if (kh_exist(idx->tname, k))
+			names[kh_val(idx->tname, k)] = kh_key(idx->tname, k);
+	return names;
+}
+
+const int *ti_get_mate_tids(const ti_index_t *idx, int mate, const char *chr, int *n)
+{
+	const ti_matemap_t *mm;
+	khint_t k;
+	*n = 0;
+	if (mate < 1 || mate > 2 || (mm = idx->matemap + mate - 1)->h == 0) return 0;
+	k = kh_get(s, mm->h, chr);
+	if (k == kh_end(mm->h)) return 0;
+	*n = mm->tids[kh_value(mm->h, k)].n;
+	return mm->tids[kh_value(mm->h, k)].tid;
+}
+
+const char **ti_get_mate_names(const ti_index_t *idx, int mate, int *n)
+{
+	*n = 0;
+	if (mate < 1 || mate > 2 || idx->matemap[mate-1].h == 0) return 0;
+	*n = idx->matemap[mate-1].n;
+	return (const char**)idx->matemap[mate-1].names;
+}
+
+ti_index_t *ti_index_load(const char *fn)
+{
+	ti_index_t *idx;
+        char *fname = get_local_version(fn);
+	if (fname == 0) return 0;
+	idx = ti_index_load_local(fname);
+	if (idx == 0) fprintf(stderr, "[ti_index_load] fail to load the index: %s\n", fname);
+        if(fname) free(fname);
+	return idx;
+}
+
+int ti_index_build2(const char *fn, const ti_conf_t *conf, const char *_fnidx)
+{
+	return ti_index_build3(fn, conf, _fnidx, 0, 0);
+}
+
+int ti_index_build3(const char *fn, const ti_conf_t *conf, const char *_fnidx, const int *statcols, int nstatcols)
+{
+	return ti_index_build4(fn, conf, _fnidx, statcols, nstatcols, 1);
+}
+
+int ti_index_build4(const char *fn, const ti_conf_t *conf, const char *_fnidx, const int *statcols, int nstatcols, int n_threads)
+{
+	char *fnidx;
+	BGZF *fp, *fpidx;
+	ti_index_t *idx;
+	if ((fp = bgzf_open(fn, "r")) == 0) {
+		fprintf(stderr, "[ti_index_build2] fail to open the file: %s\n", fn);
+		return -1;
+	}
+	if (n_threads > 1) {
+		bgzf_close(fp);
+		idx = ti_index_core_mt(fn, conf, statcols, nstatcols, n_threads);
+	} else {
+		idx = ti_index_core(fp, conf, statcols, nstatcols);
+		bgzf_close(fp);
+	}
+        if(!idx) return -1;
+	if (_fnidx == 0) {
+		fnidx = (char*)calloc(strlen(fn) + 5, 1);
+		strcpy(fnidx, fn); strcat(fnidx, ".px2");
+	} else fnidx = strdup(_fnidx);
+	fpidx = bgzf_open(fnidx, "w");
+	if (fpidx == 0) {
+		fprintf(stderr, "[ti_index_build2] fail to create the index file.\n");
+		free(fnidx);
+		return -1;
+	}
+	ti_index_save(idx, fpidx);
+	ti_index_destroy(idx);
+	bgzf_close(fpidx);
+	free(fnidx);
+	return 0;
+}
+
+int ti_index_build(const char *fn, const ti_conf_t *conf)
+{
+	return ti_index_build2(fn, conf, 0);
+}
+
+/************************************************
+ * write a bgzipped file and its index together *
+ ************************************************/
+
+// save <idx> to <_fnidx>, or <fn>.px2 if NULL
+static int ti_index_save_file(const ti_index_t *idx, const char *fn, const char *_fnidx, const char *caller)
+{
+	char *fnidx;
+	BGZF *fpidx;
+	if (_fnidx == 0) {
+		fnidx = (char*)calloc(strlen(fn) + 5, 1);
+		strcpy(fnidx, fn); strcat(fnidx, ".px2");
+	} else fnidx = strdup(_fnidx);
+	fpidx = bgzf_open(fnidx, "w");
+	free(fnidx);
+	if (fpidx == 0) {
+		fprintf(stderr, "[%s] fail to create the index file.\n", caller);
+		return -1;
+	}
+	ti_index_save(idx, fpidx);
+	bgzf_close(fpidx);
+	return 0;
+}
+
+struct __ti_writer_t {
+	BGZF *fp;
+	ti_indexer_t *ix;
+	kstring_t line, pline;
+	uint64_t pbeg, pend;  // offsets of the last line, indexed once its end offset is known for sure
+	int pending;
+	char *fn;
+	int error;
+};
+
+ti_writer_t *ti_writer_open(const char *fn, const ti_conf_t *conf, const int *statcols, int nstatcols)
+{
+	return ti_writer_open2(fn, conf, statcols, nstatcols, -1);
+}
+
+ti_writer_t *ti_writer_open2(const char *fn, const ti_conf_t *conf, const int *statcols, int nstatcols, int compress_level)
+{
+	ti_writer_t *w;
+	BGZF *fp;
+	char mode[3] = "w";
+	if (compress_level >= 0 && compress_level <= 9) mode[1] = '0' + compress_level;
+	if ((fp = bgzf_open(fn, mode)) == 0) {
+		fprintf(stderr, "[ti_writer_open] fail to create the file: %s\n", fn);
+		return 0;
+	}
+	w = (ti_writer_t*)calloc(1, sizeof(ti_writer_t));
+	w->fp = fp;
+	w->fn = strdup(fn);
+	if (conf) w->ix = ti_indexer_init(conf, statcols, nstatcols, 0);
+	return w;
+}
+
+static int ti_writer_add_pending(ti_writer_t *w)
+{
+	if (w->pending && !w->error && ti_indexer_add(w->ix, &w->pline, w->pbeg, w->pend) < 0) w->error = 1;
+	w->pending = 0;
+	return w->error? -1 : 0;
+}
+
+// index the line in w->line. The line is held until the next one: if it ends the current block, its end
+// offset is the start of the next block, as bgzf_tell() reports it when the file is read.
+static int ti_writer_index(ti_writer_t *w, uint64_t beg, uint64_t end)
+{
+	kstring_t tmp;
+	if (w->ix == 0) return 0; // no index
+	if (ti_writer_add_pending(w) < 0) return -1;
+	tmp = w->pline; w->pline = w->line; w->line = tmp;
+	w->line.l = 0;
+	w->pbeg = beg; w->pend = end; w->pending = 1;
+	return 0;
+}
+
+// write out the current block; a held line that ends it gets the address of the next block.
+static int ti_writer_flush(ti_writer_t *w)
+{
+	uint64_t off = bgzf_tell(w->fp);
+	if (bgzf_flush(w->fp) != 0) {
+		w->error = 1;
+		return -1;
+	}
+	if (w->pending && w->pend == off) w->pend = bgzf_tell(w->fp);
+	return 0;
+}
+
+int ti_writer_write(ti_writer_t *w, const char *s, int len)
+{
+	uint64_t beg = bgzf_tell(w->fp);
+	if (bgzf_write(w->fp, s, len) != len || bgzf_write(w->fp, "\n", 1) != 1) {
+		w->error = 1;
+		return -1;
+	}
+	w->line.l = 0;
+	kputsn(s, len, &w->line);
+	return ti_writer_index(w, beg, bgzf_tell(w->fp));
+}
+
+int ti_writer_copy(ti_writer_t *w, BGZF *fp, uint64_t beg, uint64_t end)
+{
+	int64_t addr = beg >> 16, next;
+	uint64_t base = 0, line_beg = 0;
+	uint8_t *buf = (uint8_t*)fp->uncompressed_block;
+	int lo, hi, o, e, raw, open = 0;
+
+	w->line.l = 0;
+	for (; addr <= (int64_t)(end >> 16); addr = next) {
+		if ((next = bgzf_load_block(fp, addr)) < 0) goto copy_error;
+		if (fp->block_length == 0) break; // end of file
+		lo = addr == (int64_t)(beg >> 16)? beg & 0xffff : 0;
+		hi = addr == (int64_t)(end >> 16)? end & 0xffff : fp->block_length;
+		if (hi > fp->block_length) hi = fp->block_length;
+		if (lo >= hi) continue;
+		// a block entirely in the range is appended as is; the index offsets are computed from its new address
+		raw = lo == 0 && hi == fp->block_length;
+		if (raw) {
+			if (ti_writer_flush(w) < 0 || bgzf_raw_copy(w->fp, fp, addr, next) < 0) goto copy_error;
+			base = (uint64_t)(w->fp->block_address - (next - addr)) << 16;
+		}
+		for (o = lo; o < hi; o = e + 1) {
+			uint8_t *p = memchr(buf + o, '\n', hi - o);
+			e = p? p - buf : hi;
+			if (!open) {
+				line_beg = raw? base | o : (uint64_t)bgzf_tell(w->fp);
+				open = 1;
+			}
+			if (!raw && bgzf_write(w->fp, buf + o, e - o + (p? 1 : 0)) != e - o + (p? 1 : 0)) goto copy_error;
+			kputsn((char*)buf + o, e - o, &w->line);
+			if (p) {
+				uint64_t line_end;
+				if (!raw) line_end = bgzf_tell(w->fp);
+				else line_end = e + 1 < fp->block_length? base | (e + 1) : (uint64_t)w->fp->block_address << 16;
+				if (ti_writer_index(w, line_beg, line_end) < 0) return -1;
+				open = 0;
+			}
+		}
+	}
+	if (open) { // last line of the file without a newline
+		if (bgzf_write(w->fp, "\n", 1) != 1) goto copy_error;
+		return ti_writer_index(w, line_beg, bgzf_tell(w->fp));
+	}
+	return 0;
+
+copy_error:
+	w->error = 1;
+	return -1;
+}
+
+int ti_writer_close(ti_writer_t *w, const char *_fnidx)
+{
+	int ret = 0;
+	uint64_t end;
+	ti_index_t *idx;
+
+	if (ti_writer_flush(w) < 0 || ti_writer_add_pending(w) < 0) ret = -1;
+	end = bgzf_tell(w->fp);
+	if (bgzf_close(w->fp) != 0) ret = -1;
+	if (w->ix == 0) ; // no index
+	else if (ret == 0) {
+		idx = ti_indexer_finish(w->ix, end);
+		ret = ti_index_save_file(idx, w->fn, _fnidx, "ti_writer_close");
+		ti_index_destroy(idx);
+	} else ti_indexer_destroy(w->ix);
+	free(w->line.s); free(w->pline.s); free(w->fn); free(w);
+	return ret;
+}
+
+typedef struct {
+	ti_indexer_t *ix;
+	kstring_t line;
+	uint64_t beg, end; // offsets of the open line; end of the last indexed line
+	int open, state;   // state: 0 while indexing, 1 once the indexer stops and -1 on failure
+} ti_block_indexer_t;
+
+// bgzf_block_f indexing the lines of a block written by bgzf_compress_file2. A line ending a block
+// ends at the start of the next one, as bgzf_tell() reports it when the file is read.
+static int ti_index_block(void *data, int64_t addr, int64_t next, const uint8_t *block, int len)
+{
+	ti_block_indexer_t *b = (ti_block_indexer_t*)data;
+	int o, e;
+	if (b->state != 0) return b->state;
+	if (len == 0) { // end of file; a last line without a newline ends there too
+		if (!b->open) return 0;
+		b->end = (uint64_t)addr << 16;
+		return b->state = ti_indexer_add(b->ix, &b->line, b->beg, b->end);
+	}
+	for (o = 0; o < len; o = e + 1) {
+		const uint8_t *p = memchr(block + o, '\n', len - o);
+		e = p? p - block : len;
+		if (!b->open) {
+			b->beg = (uint64_t)addr << 16 | o;
+			b->line.l = 0;
+			b->open = 1;
+		}
+		kputsn((const char*)block + o, e - o, &b->line);
+		if (p) {
+			b->end = e + 1 < len? (uint64_t)addr << 16 | (e + 1) : (uint64_t)next << 16;
+			b->open = 0;
+			if ((b->state = ti_indexer_add(b->ix, &b->line, b->beg, b->end)) != 0) break;
+		}
+	}
+	return b->state;
+}
+
+int ti_index_bgzip(const char *fnin, const char *fnout, const ti_conf_t *conf, const char *_fnidx, const int *statcols, int nstatcols, int compress_level, int n_threads)
+{
+	ti_block_indexer_t b;
+	ti_index_t *idx;
+	int ret;
+
+	memset(&b, 0, sizeof(ti_block_indexer_t));
+	b.ix = ti_indexer_init(conf, statcols, nstatcols, 0);
+	ret = bgzf_compress_file2(fnin, fnout, compress_level, n_threads, ti_index_block, &b);
+	free(b.line.s);
+	if (ret != 0) {
+		ti_indexer_destroy(b.ix);
+		return ret;
+	}
+	idx = ti_indexer_finish(b.ix, b.end);
+	ret = ti_index_save_file(idx, fnout, _fnidx, "ti_index_bgzip") < 0? -6 : 0;
+	ti_index_destroy(idx);
+	return ret;
+}
+
+/*************************************
+ * secondary index on the read names *
+ *************************************/
+
+// 32-bit hash of a read name (FNV-1a, mixed with the murmur3 finalizer)
+static uint32_t read_hash(const char *s, int len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+	for (i = 0; i < len; ++i) {
+		h ^= (uint8_t)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (uint32_t)(h >> 32);
+}
+
+// the <col>-th (0-based) field of a line: returns its length and sets <field>, or -1 if the line has fewer fields
+static int get_field(const kstring_t *str, int col, char delimiter, char **field)
+{
+	int i, k = 0, beg = 0;
+	for (i = 0; i <= (int)str->l; ++i) {
+		if (i == (int)str->l || str->s[i] == delimiter) {
+			if (k++ == col) {
+				*field = str->s + beg;
+				return i - beg;
+			}
+			beg = i + 1;
+		}
+	}
+	return -1;
+}
+
+// add the read name of a line starting in entry <b> of the block offset table
+static void readindex_add(ti_readindex_t *ri, const kstring_t *str, char delimiter, int64_t b)
+{
+	char *s;
+	int l = get_field(str, ri->col, delimiter, &s);
+	if (l < 0) return;
+	if (ri->n == ri->m) {
+		ri->m = ri->m? ri->m<<1 : 1024;
+		ri->a = (uint64_t*)realloc(ri->a, ri->m * 8);
+	}
+	ri->a[ri->n++] = (uint64_t)read_hash(s, l) << 32 | (uint32_t)b;
+}
+
+// sort the entries and remove the duplicates (reads with several lines in a block, or hash collisions in a block)
+static void readindex_sort(ti_readindex_t *ri)
+{
+	int64_t i, k;
+	if (ri->n == 0) return;
+	ks_introsort(uint64_t, ri->n, ri->a);
+	for (i = k = 1; i < ri->n; ++i)
+		if (ri->a[i] != ri->a[k-1]) ri->a[k++] = ri->a[i];
+	ri->n = k;
+}
+
+int64_t ti_index_reads(const char *fn, const char *_fnidx, int col)
+{
+	const ti_blocktable_t *bt;
+	ti_index_t *idx;
+	BGZF *fp;
+	kstring_t str = {0, 0, 0};
+	uint64_t off = 0, lineno = 0;
+	int64_t b = -1, ret;
+	char *fnidx;
+	int r = 0;
+
+	if (_fnidx == 0) {
+		fnidx = (char*)calloc(strlen(fn) + 5, 1);
+		strcpy(fnidx, fn); strcat(fnidx, ".px2");
+	} else fnidx = strdup(_fnidx);
+	idx = ti_index_load_local(fnidx);
+	free(fnidx);
+	if (idx == 0) return -1;
+	if ((bt = idx->blocks) == 0) {
+		fprintf(stderr, "[ti_index_reads] the index has no block offset table. Re-index the file.\n");
+		ti_index_destroy(idx);
+		return -2;
+	}
+	if ((fp = bgzf_open(fn, "r")) == 0) {
+		fprintf(stderr, "[ti_index_reads] fail to open the file: %s\n", fn);
+		ti_index_destroy(idx);
+		return -1;
+	}
+	if (idx->reads == 0) idx->reads = (ti_readindex_t*)calloc(1, sizeof(ti_readindex_t));
+	idx->reads->n = 0;
+	idx->reads->col = col >= 0? col : (idx->conf.preset&0xffff) == TI_PRESET_MERGED_NODUPS? 14 : 0;
+	while (off < bt->voff_end && (r = ti_readline(fp, &str)) >= 0) { // the indexed lines
+		while (b + 1 < bt->n && bt->voff[b+1] <= off) ++b;
+		if (++lineno > (uint64_t)idx->conf.line_skip && str.s[0] != idx->conf.meta_char && b >= 0)
+			readindex_add(idx->reads, &str, idx->conf.delimiter, b);
+		off = bgzf_tell(fp);
+	}
+	free(str.s);
+	bgzf_close(fp);
+	if (r < -1) ret = -3;
+	else {
+		readindex_sort(idx->reads);
+		ret = ti_index_save_file(idx, fn, _fnidx, "ti_index_reads") < 0? -4 : idx->reads->n;
+	}
+	ti_index_destroy(idx);
+	return ret;
+}
+
+int64_t ti_lookup_reads(BGZF *fp, const ti_index_t *idx, const char **ids, int n, void *data, ti_fetch_f func)
+{
+	const ti_readindex_t *ri = idx->reads;
+	const ti_blocktable_t *bt = idx->blocks;
+	kstring_t str = {0, 0, 0};
+	khash_t(s) *h;
+	uint64_t *blocks = 0;
+	int64_t nb = 0, mb = 0, i, n_found = 0;
+	int absent, ret = 0;
+	if (ri == 0 || bt == 0) return -1;
+	// the blocks holding a line whose read name has the hash of one of the ids
+	h = kh_init(s);
+	for (i = 0; i < n; ++i) {
+		uint32_t x = read_hash(ids[i], strlen(ids[i]));
+		int64_t lo = 0, hi = ri->n, mid;
+		kh_put(s, h, ids[i], &absent);
+		if (!absent) continue;
+		while (lo < hi) { // the first entry with hash x
+			mid = (lo + hi) >> 1;
+			if (ri->a[mid] >> 32 < x) lo = mid + 1;
+			else hi = mid;
+		}
+		for (; lo < ri->n && ri->a[lo] >> 32 == x; ++lo) {
+			if (nb == mb) {
+				mb = mb? mb<<1 : 16;
+				blocks = (uint64_t*)realloc(blocks, mb * 8);
+			}
+			blocks[nb++] = (uint32_t)ri->a[lo];
+		}
+	}
+	if (nb > 0) ks_introsort(uint64_t, nb, blocks);
+	// read the lines starting in each block, once, in file order
+	for (i = 0; i < nb && ret == 0; ++i) {
+		uint64_t end;
+		if ((i > 0 && blocks[i] == blocks[i-1]) || (int64_t)blocks[i] >= bt->n) continue;
+		end = (int64_t)blocks[i] + 1 < bt->n? bt->voff[blocks[i]+1] : bt->voff_end;
+		if (bgzf_seek(fp, bt->voff[blocks[i]], SEEK_SET) < 0) { ret = -2; break; }
+		while ((uint64_t)bgzf_tell(fp) < end) {
+			char *name, c;
+			int l, hit;
+			if (ti_readline(fp, &str) < 0) { ret = -2; break; }
+			if (str.s[0] == idx->conf.meta_char || (l = get_field(&str, ri->col, idx->conf.delimiter, &name)) < 0) continue;
+			c = name[l]; name[l] = 0;
+			hit = kh_get(s, h, name) != kh_end(h);
+			name[l] = c;
+			if (hit) {
+				func(str.l, str.s, data);
+				++n_found;
+			}
+		}
+	}
+	free(str.s); free(blocks);
+	kh_destroy(s, h);
+	return ret < 0? ret : n_found;
+}
+
+/*******************************************
+ * parallel scan of the indexed data lines *
+ *******************************************/
+
+#define APPLY_RANGES_PER_THREAD 4
+
+typedef struct {
+	const char *fn;
+	const ti_index_t *idx;
+	const ti_accumulator_t *acc;
+	void *arg;
+	const int64_t *part;  // ranges of entries of the block offset table (see ti_partition)
+	int n_parts, next, stop;
+	pthread_mutex_t lock;
+} apply_shared_t;
+
+typedef struct {
+	apply_shared_t *sh;
+	void *result;
+	int error;  // -2 on a read error, -3 if the accumulator stopped the scan
+	int started;  // run on its own thread (to be joined)
+} apply_worker_t;
+
+// the interval of a data line, with the tid of its key looked up without modifying the index (the keys of the
+// indexed lines are all in it). Returns -1 if the line can't be parsed or its key is not in the index.
+static int apply_get_intv(const ti_index_t *idx, kstring_t *str, kstring_t *name, ti_intv_t *intv)
+{
+	ti_interval_t x;
+	if (ti_get_intv(&idx->conf, str->l, str->s, &x) < 0) return -1;
+	name->l = 0;
+	kputsn(x.ss, x.se - x.ss, name);
+	if (x.ss2) {
+		kputc(idx->conf.region_split_character, name);
+		kputsn(x.ss2, x.se2 - x.ss2, name);
+	}
+	if ((intv->tid = ti_get_tid(idx, name->s)) < 0) return -1;
+	intv->beg = x.beg; intv->end = x.end;
+	intv->beg2 = x.beg2; intv->end2 = x.end2;
+	intv->bin = ti_reg2bin(intv->beg, intv->end);
+	intv->bin2 = ti_reg2bin(intv->beg2, intv->end2);
+	return 0;
+}
+
+// scan the ranges taken from the shared counter, adding their data lines to the partial result of the worker
+static void *apply_worker(void *data)
+{
+	apply_worker_t *w = (apply_worker_t*)data;
+	apply_shared_t *sh = w->sh;
+	const ti_blocktable_t *bt = sh->idx->blocks;
+	const ti_conf_t *conf = &sh->idx->conf;
+	kstring_t str = {0, 0, 0}, name = {0, 0, 0};
+	ti_intv_t intv;
+	BGZF *fp;
+	int k;
+	if ((fp = bgzf_open(sh->fn, "r")) == 0) {
+		w->error = -2;
+		return 0;
+	}
+	while (w->error == 0) {
+		uint64_t end, lineno;
+		pthread_mutex_lock(&sh->lock);
+		k = sh->stop || sh->next == sh->n_parts? -1 : sh->next++;
+		pthread_mutex_unlock(&sh->lock);
+		if (k < 0) break;
+		end = sh->part[k+1] < bt->n? bt->voff[sh->part[k+1]] : bt->voff_end;
+		lineno = bt->line[sh->part[k]];
+		if (bgzf_seek(fp, bt->voff[sh->part[k]], SEEK_SET) < 0) w->error = -2;
+		while (w->error == 0 && (uint64_t)bgzf_tell(fp) < end) {
+			if (ti_readline(fp, &str) < 0) w->error = -2;
+			else if (++lineno <= (uint64_t)conf->line_skip || str.s[0] == conf->meta_char) continue;
+			else if (apply_get_intv(sh->idx, &str, &name, &intv) == 0 && sh->acc->add(w->result, str.s, str.l, &intv, sh->arg) < 0)
+				w->error = -3;
+		}
+		if (w->error) { // the other workers stop after their current range
+			pthread_mutex_lock(&sh->lock);
+			sh->stop = 1;
+			pthread_mutex_unlock(&sh->lock);
+		}
+	}
+	free(str.s); free(name.s);
+	bgzf_close(fp);
+	return 0;
+}
+
+int ti_apply(const char *fn, const ti_index_t *idx, int n_threads, const ti_accumulator_t *acc, void *arg, void **result)
+{
+	apply_shared_t sh;
+	apply_worker_t *w;
+	pthread_t *tid;
+	int64_t *part;
+	int i, ret = 0;
+
+	*result = 0;
+	if (idx->blocks == 0) return -1;
+	if (n_threads < 1) n_threads = 1;
+	memset(&sh, 0, sizeof(apply_shared_t));
+	sh.fn = fn; sh.idx = idx; sh.acc = acc; sh.arg = arg;
+	part = (int64_t*)malloc((n_threads * APPLY_RANGES_PER_THREAD + 1) * sizeof(int64_t));
+	sh.n_parts = ti_partition(idx, n_threads * APPLY_RANGES_PER_THREAD, part); // more ranges than threads, to balance the load
+	sh.part = part;
+	if (sh.n_parts < n_threads) n_threads = sh.n_parts > 0? sh.n_parts : 1;
+	pthread_mutex_init(&sh.lock, 0);
+	w = (apply_worker_t*)calloc(n_threads, sizeof(apply_worker_t));
+	tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	for (i = 0; i < n_threads; ++i) {
+		w[i].sh = &sh;
+		w[i].result = acc->init(idx, arg);
+	}
+	if (n_threads == 1) apply_worker(w);
+	else {
+		for (i = 0; i < n_threads; ++i) w[i].started = pthread_create(&tid[i], 0, apply_worker, w + i) == 0;
+		for (i = 0; i < n_threads; ++i) // the workers without a thread take their ranges from this one
+			if (!w[i].started) apply_worker(w + i);
+		for (i = 0; i < n_threads; ++i)
+			if (w[i].started) pthread_join(tid[i], 0);
+	}
+	// merge the partial results in worker order
+	for (i = 0; i < n_threads; ++i)
+		if (w[i].error && (ret == 0 || w[i].error == -2)) ret = w[i].error;
+	for (i = 1; i < n_threads; ++i) {
+		if (ret == 0) acc->merge(w[0].result, w[i].result, arg);
+		acc->destroy(w[i].result, arg);
+	}
+	if (ret == 0) *result = w[0].result;
+	else acc->destroy(w[0].result, arg);
+	pthread_mutex_destroy(&sh.lock);
+	free(w); free(tid); free(part);
+	return ret;
+}
+
+/*********************************************
+ * update the index of a file with new lines *
+ *********************************************/
+
+// an indexer adding lines to <idx> from virtual offset <off>: the keys of the lines must come after the last
+// key of <idx> (a line of the last key is out of order, as its last position is not in the index)
+static ti_indexer_t *ti_indexer_resume(ti_index_t *idx, uint64_t off)
+{
+	ti_indexer_t *ix = indexer_new(idx, off);
+	idx->max = idx->n; // the arrays of a loaded index are not larger
+	if (idx->n) { // the last key of the index, at a position after all its lines
+		ix->last_tid = idx->n - 1;
+		ix->last_coor = INT32_MAX;
+	}
+	ix->lineno = idx->linecount;
+	if (idx->chunkstats) ix->m_blocks = idx->chunkstats->nblocks;
+	return ix;
+}
+
+int ti_index_update(const char *fn, const char *_fnidx, uint64_t *n_lines)
+{
+	ti_indexer_t *ix;
+	ti_index_t *idx;
+	BGZF *fp;
+	kstring_t str = {0, 0, 0};
+	uint64_t off = 0, linecount;
+	char *fnidx;
+	int i, ret = 0;
+
+	if (_fnidx == 0) {
+		fnidx = (char*)calloc(strlen(fn) + 5, 1);
+		strcpy(fnidx, fn); strcat(fnidx, ".px2");
+	} else fnidx = strdup(_fnidx);
+	idx = ti_index_load_local(fnidx);
+	free(fnidx);
+	if (idx == 0) return -1;
+	linecount = idx->linecount;
+	if ((fp = bgzf_open(fn, "r")) == 0) {
+		fprintf(stderr, "[ti_index_update] fail to open the file: %s\n", fn);
+		ti_index_destroy(idx);
+		return -1;
+	}
+	if (idx->n > 0) { // the new lines start after the last indexed line
+		int usize, len;
+		if (idx->keystats == 0) {
+			fprintf(stderr, "[ti_index_update] the index has no key statistics. Re-index the file.\n");
+			ret = -2;
+			goto end_update;
+		}
+		for (i = 0; i < idx->n; ++i)
+			if (idx->keystats[i].n > 0 && idx->keystats[i].off_end > off) off = idx->keystats[i].off_end;
+		len = bgzf_block_info(fp, off >> 16, &usize);
+		if (len < 0) {
+			fprintf(stderr, "[ti_index_update] the indexed data of the file has changed. Re-index the file.\n");
+			ret = -3;
+			goto end_update;
+		}
+		if (len > 0 && usize == 0 && bgzf_block_info(fp, (off >> 16) + len, &usize) > 0) {
+			fprintf(stderr, "[ti_index_update] the end-of-file marker is still before the new lines.\n");
+			ret = -4;
+			goto end_update;
+		}
+	} else { // no key : index the whole file again
+		idx->linecount = 0;
+		ti_blocktable_destroy(idx->blocks);
+		idx->blocks = (ti_blocktable_t*)calloc(1, sizeof(ti_blocktable_t));
+		if (idx->reads) idx->reads->n = 0;
+	}
+	if (bgzf_seek(fp, off, SEEK_SET) < 0) {
+		ret = -3;
+		goto end_update;
+	}
+	ix = ti_indexer_resume(idx, off);
+	while (ti_readline(fp, &str) >= 0) {
+		if ((ret = ti_indexer_add(ix, &str, off, bgzf_tell(fp))) != 0) break;
+		if (idx->reads && idx->blocks && idx->linecount > (uint64_t)idx->conf.line_skip && str.s[0] != idx->conf.meta_char)
+			readindex_add(idx->reads, &str, idx->conf.delimiter, idx->blocks->n - 1);
+		off = bgzf_tell(fp);
+	}
+	free(str.s);
+	if (ret < 0) {
+		fprintf(stderr, "[ti_index_update] the new lines must be sorted, with keys that are not in the index.\n");
+		ti_indexer_destroy(ix);
+		bgzf_close(fp);
+		return -5;
+	}
+	idx = ti_indexer_finish(ix, bgzf_tell(fp));
+	if (idx->reads) readindex_sort(idx->reads);
+	if (n_lines) *n_lines = idx->linecount - linecount;
+	ret = ti_index_save_file(idx, fn, _fnidx, "ti_index_update") < 0? -6 : 0;
+end_update:
+	ti_index_destroy(idx);
+	bgzf_close(fp);
+	return ret;
 }
 
-ti_index_t *ti_index_load_local(const char *fnidx)
-{
+/*****************************************
+ * external-memory sort of a text file *
+ *****************************************/
+
+typedef struct {
+	char *s, *ss, *se, *ss2, *se2; // line; sequence name(s) from ti_get_intv
+	int l, beg;
+	uint64_t i; // line number, for a stable order
+} ti_sort_line_t;
+
+typedef struct {
+	const ti_conf_t *conf;
+	ti_sort_line_t *a;
+	size_t n;
+	int error;
+	int started; // sorted on its own thread (to be joined)
+} ti_sort_part_t;
+
+typedef struct {
+	ti_sort_line_t *a, cur; // an in-memory sorted part (a[i..n)) or a run spilled to <fp>; cur is the next line
+	size_t i, n;
 	BGZF *fp;
-	fp = bgzf_open(fnidx, "r");
-	if (fp) {
-		ti_index_t *idx = ti_index_load_core(fp);
-		bgzf_close(fp);
-		return idx;
-	} else return 0;
+	kstring_t str;
+} ti_sort_src_t;
+
+static inline int ti_sort_name_cmp(const char *s1, const char *e1, const char *s2, const char *e2)
+{
+	int l1 = e1 - s1, l2 = e2 - s2, c = memcmp(s1, s2, l1 < l2? l1 : l2);
+	return c? c : l1 - l2;
 }
 
-#ifdef _USE_KNETFILE
-static void download_from_remote(const char *url)
+// order of the index: sequence name (pair), then start
+static inline int ti_sort_key_cmp(const ti_sort_line_t *a, const ti_sort_line_t *b)
 {
-	const int buf_size = 1 * 1024 * 1024;
-	char *fn;
-	FILE *fp;
-	uint8_t *buf;
-	knetFile *fp_remote;
-	int l;
-	if (strstr(url, "ftp://") != url && strstr(url, "http://") != url) return;
-	l = strlen(url);
-	for (fn = (char*)url + l - 1; fn >= url; --fn)
-		if (*fn == '/') break;
-	++fn; // fn now points to the file name
-	fp_remote = knet_open(url, "r");
-	if (fp_remote == 0) {
-		fprintf(stderr, "[download_from_remote] fail to open remote file.\n");
-		return;
+	int c = ti_sort_name_cmp(a->ss, a->se, b->ss, b->se);
+	if (c == 0 && a->ss2) c = ti_sort_name_cmp(a->ss2, a->se2, b->ss2, b->se2);
+	if (c == 0) c = (a->beg > b->beg) - (a->beg < b->beg);
+	return c;
+}
+
+// ties keep the order of the input
+static int ti_sort_line_cmp(const void *_a, const void *_b)
+{
+	const ti_sort_line_t *a = (const ti_sort_line_t*)_a, *b = (const ti_sort_line_t*)_b;
+	int c = ti_sort_key_cmp(a, b);
+	return c? c : (a->i > b->i) - (a->i < b->i);
+}
+
+static int ti_sort_parse(const ti_conf_t *conf, ti_sort_line_t *r)
+{
+	ti_interval_t x;
+	if (ti_get_intv(conf, r->l, r->s, &x) != 0) {
+		fprintf(stderr, "[ti_sort_file] the following line cannot be parsed: %s\n", r->s);
+		return -1;
 	}
-	if ((fp = fopen(fn, "w")) == 0) {
-		fprintf(stderr, "[download_from_remote] fail to create file in the working directory.\n");
-		knet_close(fp_remote);
-		return;
+	r->ss = x.ss; r->se = x.se; r->ss2 = x.ss2; r->se2 = x.se2; r->beg = x.beg;
+	return 0;
+}
+
+static void *ti_sort_worker(void *data)
+{
+	ti_sort_part_t *p = (ti_sort_part_t*)data;
+	size_t i;
+	for (i = 0; i < p->n; ++i)
+		if (ti_sort_parse(p->conf, p->a + i) < 0) { p->error = 1; return 0; }
+	qsort(p->a, p->n, sizeof(ti_sort_line_t), ti_sort_line_cmp);
+	return 0;
+}
+
+// load the next line of a source into src->cur; return -1 at the end and -2 on error
+static int ti_sort_next(const ti_conf_t *conf, ti_sort_src_t *src)
+{
+	int ret;
+	if (src->fp == 0) {
+		if (src->i == src->n) return -1;
+		src->cur = src->a[src->i++];
+		return 0;
 	}
-	buf = (uint8_t*)calloc(buf_size, 1);
-	while ((l = knet_read(fp_remote, buf, buf_size)) != 0)
-		fwrite(buf, 1, l, fp);
-	free(buf);
-	fclose(fp);
-	knet_close(fp_remote);
+	if ((ret = bgzf_getline(src->fp, '\n', &src->str)) < 0) return ret == -1? -1 : -2;
+	src->cur.s = src->str.s; src->cur.l = src->str.l;
+	return ti_sort_parse(conf, &src->cur) < 0? -2 : 0;
 }
-#else
-static void download_from_remote(const char *url)
+
+// sources are compared on their current line; ties go to the earlier source (earlier lines of the input)
+static inline int ti_sort_src_lt(const ti_sort_src_t *src, int a, int b)
 {
-	return;
+	int c = ti_sort_key_cmp(&src[a].cur, &src[b].cur);
+	return c < 0 || (c == 0 && a < b);
 }
-#endif
 
-static char *get_local_version(const char *fn)
+static void ti_sort_heap_down(const ti_sort_src_t *src, int *heap, int n, int i)
 {
-        struct stat sbuf;
-	char *fnidx = (char*)calloc(strlen(fn) + 5, 1);
-	strcat(strcpy(fnidx, fn), ".px2");
-	if ((strstr(fnidx, "ftp://") == fnidx || strstr(fnidx, "http://") == fnidx)) {
-		char *p, *url;
-		int l = strlen(fnidx);
-		for (p = fnidx + l - 1; p >= fnidx; --p)
-			if (*p == '/') break;
-		url = fnidx; fnidx = strdup(p + 1);
-		if (stat(fnidx, &sbuf) == 0) {
-			free(url);
-			return fnidx;
-		}
-		fprintf(stderr, "[%s] downloading the index file...\n", __func__);
-		download_from_remote(url);
-		free(url);
+	int k, tmp;
+	while ((k = 2 * i + 1) < n) {
+		if (k + 1 < n && ti_sort_src_lt(src, heap[k + 1], heap[k])) ++k;
+		if (!ti_sort_src_lt(src, heap[k], heap[i])) break;
+		tmp = heap[i]; heap[i] = heap[k]; heap[k] = tmp;
+		i = k;
 	}
-        if (stat(fnidx, &sbuf) == 0) return fnidx;
-	free(fnidx);
-        return 0;
 }
 
-const char **ti_seqname(const ti_index_t *idx, int *n)
+// k-way merge of sorted sources into <fp> (a spilled run) or <w>; return 0, -2 on a write error and -5 on a parse error
+static int ti_sort_merge(const ti_conf_t *conf, ti_sort_src_t *src, int n_src, BGZF *fp, ti_writer_t *w)
 {
-	const char **names;
-	khint_t k;
-	*n = idx->n;
-	names = calloc(idx->n, sizeof(void*));
-	for (k = kh_begin(idx->tname); k < kh_end(idx->tname); ++k)
-		if (kh_exist(idx->tname, k))
-			names[kh_val(idx->tname, k)] = kh_key(idx->tname, k);
-	return names;
+	int i, n = 0, ret = 0, *heap = (int*)malloc((n_src + 1) * sizeof(int));
+	for (i = 0; i < n_src; ++i) {
+		int r = ti_sort_next(conf, src + i);
+		if (r == -2) ret = -5;
+		else if (r == 0) heap[n++] = i;
+	}
+	for (i = n / 2 - 1; i >= 0; --i) ti_sort_heap_down(src, heap, n, i);
+	while (n > 0 && ret == 0) {
+		ti_sort_src_t *s = src + heap[0];
+		int r;
+		if (fp) {
+			if (bgzf_write(fp, s->cur.s, s->cur.l) != s->cur.l || bgzf_write(fp, "\n", 1) != 1) ret = -2;
+		} else if (ti_writer_write(w, s->cur.s, s->cur.l) < 0) ret = -2;
+		if ((r = ti_sort_next(conf, s)) == -2) ret = -5;
+		else if (r == -1) heap[0] = heap[--n];
+		ti_sort_heap_down(src, heap, n, 0);
+	}
+	free(heap);
+	return ret;
 }
 
-ti_index_t *ti_index_load(const char *fn)
+// read a line of <fp> without its newline; return -1 at the end of the file and -3 on a read error
+static int ti_sort_getline(gzFile fp, kstring_t *str)
 {
-	ti_index_t *idx;
-        char *fname = get_local_version(fn);
-	if (fname == 0) return 0;
-	idx = ti_index_load_local(fname);
-	if (idx == 0) fprintf(stderr, "[ti_index_load] fail to load the index: %s\n", fname);
-        if(fname) free(fname);
-	return idx;
+	str->l = 0;
+	for (;;) {
+		if (str->m - str->l < 1024) {
+			str->m = str->m? str->m << 1 : 0x10000;
+			str->s = (char*)realloc(str->s, str->m);
+		}
+		if (gzgets(fp, str->s + str->l, str->m - str->l) == 0) break;
+		str->l += strlen(str->s + str->l);
+		if (str->l > 0 && str->s[str->l - 1] == '\n') {
+			str->s[--str->l] = 0;
+			return str->l;
+		}
+	}
+	if (!gzeof(fp)) return -3;
+	return str->l > 0? (int)str->l : -1;
+}
+
+// open <fn> for reading, or a duplicate of stdin if <fn> is "-" so that gzclose leaves the caller's stdin open
+static gzFile ti_gzopen_input(const char *fn)
+{
+	gzFile in;
+	int fd;
+	if (strcmp(fn, "-") != 0) return gzopen(fn, "rb");
+	if ((fd = dup(fileno(stdin))) < 0) return 0;
+	if ((in = gzdopen(fd, "rb")) == 0) close(fd);
+	return in;
+}
+
+int ti_sort_file(const char *fnin, const char *fnout, const ti_conf_t *conf, const char *_fnidx, const int *statcols, int nstatcols,
+                 size_t max_mem, const char *tmpdir, int compress_level, int n_threads)
+{
+	gzFile in;
+	ti_writer_t *w;
+	kstring_t str = {0, 0, 0}, buf = {0, 0, 0}, header = {0, 0, 0};
+	ti_sort_line_t *a = 0;
+	ti_sort_part_t *parts;
+	ti_sort_src_t *src = 0;
+	pthread_t *tid;
+	char **runs = 0;
+	size_t n = 0, m = 0, j;
+	uint64_t lineno = 0;
+	int i, r = 0, n_runs = 0, ret = 0, done = 0;
+
+	if (n_threads < 1) n_threads = 1;
+	in = ti_gzopen_input(fnin);
+	if (in == 0) return -1;
+	if ((w = ti_writer_open2(fnout, conf, statcols, nstatcols, compress_level)) == 0) {
+		gzclose(in);
+		return -2;
+	}
+	parts = (ti_sort_part_t*)calloc(n_threads, sizeof(ti_sort_part_t));
+	tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	src = (ti_sort_src_t*)calloc(n_threads, sizeof(ti_sort_src_t));
+	// runs of at most <max_mem> bytes are sorted on <n_threads> threads; all but a single run are spilled to temporary files
+	while (!done && ret == 0) {
+		size_t per;
+		buf.l = 0; n = 0;
+		while (buf.l + n * sizeof(ti_sort_line_t) < max_mem || n == 0) {
+			if ((r = ti_sort_getline(in, &str)) < 0) {
+				if (r == -3) ret = -3;
+				done = 1;
+				break;
+			}
+			++lineno;
+			if (lineno <= (uint64_t)conf->line_skip || str.s[0] == conf->meta_char) { // header lines are written first
+				kputsn(str.s, str.l + 1, &header);
+				continue;
+			}
+			if (n == m) {
+				m = m? m << 1 : 0x10000;
+				a = (ti_sort_line_t*)realloc(a, m * sizeof(ti_sort_line_t));
+			}
+			a[n].s = (char*)buf.l; // offset until the run is complete
+			a[n].l = str.l;
+			a[n++].i = lineno;
+			kputsn(str.s, str.l + 1, &buf);
+		}
+		if (ret != 0 || (n == 0 && n_runs > 0)) break;
+		for (j = 0; j < n; ++j) a[j].s = buf.s + (size_t)a[j].s;
+		per = (n + n_threads - 1) / n_threads;
+		for (i = 0; i < n_threads; ++i) {
+			parts[i].conf = conf;
+			parts[i].a = a + (i * per < n? i * per : n);
+			parts[i].n = (i + 1) * per < n? per : (i * per < n? n - i * per : 0);
+			parts[i].error = 0;
+			parts[i].started = pthread_create(&tid[i], 0, ti_sort_worker, parts + i) == 0;
+			if (!parts[i].started) ti_sort_worker(parts + i); // no thread left: sort the part in this one
+		}
+		for (i = 0; i < n_threads; ++i) {
+			if (parts[i].started) pthread_join(tid[i], 0);
+			if (parts[i].error) ret = -5;
+			memset(src + i, 0, sizeof(ti_sort_src_t));
+			src[i].a = parts[i].a; src[i].n = parts[i].n;
+		}
+		if (ret != 0) break;
+		if (done && n_runs == 0) { // a single run goes straight to the output
+			for (j = 0; j < header.l; j += strlen(header.s + j) + 1)
+				if (ti_writer_write(w, header.s + j, strlen(header.s + j)) < 0) ret = -2;
+			if (ret == 0) ret = ti_sort_merge(conf, src, n_threads, 0, w);
+			header.l = 0;
+		} else {
+			BGZF *fp;
+			char *fn = (char*)malloc(strlen(tmpdir? tmpdir : ".") + 64);
+			sprintf(fn, "%s/pxsort.%d.%p.%d.gz", tmpdir? tmpdir : ".", (int)getpid(), (void*)w, n_runs);
+			runs = (char**)realloc(runs, (n_runs + 1) * sizeof(char*));
+			runs[n_runs++] = fn;
+			if ((fp = bgzf_open(fn, "w1")) == 0) {
+				fprintf(stderr, "[ti_sort_file] fail to create the temporary file: %s\n", fn);
+				ret = -2;
+			} else {
+				ret = ti_sort_merge(conf, src, n_threads, fp, 0);
+				if (bgzf_close(fp) != 0 && ret == 0) ret = -2;
+			}
+		}
+	}
+	gzclose(in);
+	free(str.s); free(buf.s); free(a);
+	if (ret == 0 && n_runs > 0) { // merge the spilled runs
+		src = (ti_sort_src_t*)realloc(src, n_runs * sizeof(ti_sort_src_t));
+		memset(src, 0, n_runs * sizeof(ti_sort_src_t));
+		for (j = 0; j < header.l; j += strlen(header.s + j) + 1)
+			if (ti_writer_write(w, header.s + j, strlen(header.s + j)) < 0) ret = -2;
+		for (i = 0; i < n_runs && ret == 0; ++i)
+			if ((src[i].fp = bgzf_open(runs[i], "r")) == 0) ret = -2;
+		if (ret == 0) ret = ti_sort_merge(conf, src, n_runs, 0, w);
+		for (i = 0; i < n_runs; ++i) {
+			if (src[i].fp) bgzf_close(src[i].fp);
+			free(src[i].str.s);
+		}
+	}
+	for (i = 0; i < n_runs; ++i) { remove(runs[i]); free(runs[i]); }
+	free(runs); free(src); free(parts); free(tid); free(header.s);
+	if (ret != 0) { // no index, and no partial output
+		w->error = 1;
+		ti_writer_close(w, 0);
+		remove(fnout);
+	} else if (ti_writer_close(w, _fnidx) < 0) ret = -6;
+	return ret;
 }
 
-int ti_index_build2(const char *fn, const ti_conf_t *conf, const char *_fnidx)
+/**********************************************
+ * convert a Juicer merged_nodups file to pairs *
+ **********************************************/
+
+typedef struct {
+	size_t s;   // offset of the converted line in the buffer of its block
+	int l, pos;
+	uint64_t i; // line number, for a stable order
+} ti_mnd_line_t;
+
+static int ti_mnd_line_cmp(const void *_a, const void *_b)
 {
-	char *fnidx;
-	BGZF *fp, *fpidx;
-	ti_index_t *idx;
-	if ((fp = bgzf_open(fn, "r")) == 0) {
-		fprintf(stderr, "[ti_index_build2] fail to open the file: %s\n", fn);
-		return -1;
+	const ti_mnd_line_t *a = (const ti_mnd_line_t*)_a, *b = (const ti_mnd_line_t*)_b;
+	if (a->pos != b->pos) return a->pos < b->pos? -1 : 1;
+	return a->i < b->i? -1 : a->i > b->i;
+}
+
+// sort the lines of a chromosome-pair block by pos1 and write them
+static int ti_mnd_flush(ti_writer_t *w, ti_mnd_line_t *a, size_t n, const kstring_t *buf)
+{
+	size_t j;
+	qsort(a, n, sizeof(ti_mnd_line_t), ti_mnd_line_cmp);
+	for (j = 0; j < n; ++j)
+		if (ti_writer_write(w, buf->s + a[j].s, a[j].l) < 0) return -1;
+	return 0;
+}
+
+// convert a line of merged_nodups (str1 chr1 pos1 frag1 str2 chr2 pos2 frag2 ... readname1 ...) or old_merged_nodups
+// (readname str1 chr1 pos1 frag1 str2 chr2 pos2 frag2 ...) into a pairs line appended to <out>; <key> is set to chr1|chr2.
+static int ti_mnd_convert(char *s, int old, kstring_t *out, kstring_t *key, int *pos)
+{
+	char *f[16], *p, *end;
+	int fl[16], n = 0, j;
+	static const int col[2][9] = { { 14, 1, 2, 5, 6, 0, 4, 3, 7 }, { 0, 2, 3, 6, 7, 1, 5, 4, 8 } }; // readID chr1 pos1 chr2 pos2 str1 str2 frag1 frag2
+	for (p = s; *p && n < 16; ) {
+		while (*p == ' ') ++p;
+		if (*p == 0) break;
+		f[n] = p;
+		while (*p && *p != ' ') ++p;
+		fl[n] = p - f[n];
+		++n;
+		if (*p) *p++ = 0;
 	}
-	idx = ti_index_core(fp, conf);
-        if(!idx) return -1;
-	bgzf_close(fp);
-	if (_fnidx == 0) {
-		fnidx = (char*)calloc(strlen(fn) + 5, 1);
-		strcpy(fnidx, fn); strcat(fnidx, ".px2");
-	} else fnidx = strdup(_fnidx);
-	fpidx = bgzf_open(fnidx, "w");
-	if (fpidx == 0) {
-		fprintf(stderr, "[ti_index_build2] fail to create the index file.\n");
-		free(fnidx);
-		return -1;
+	if (n < (old? 9 : 8)) return -1;
+	*pos = strtol(f[col[old][2]], &end, 10);
+	if (*end || end == f[col[old][2]]) return -1;
+	strtol(f[col[old][4]], &end, 10);
+	if (*end || end == f[col[old][4]]) return -1;
+	key->l = 0;
+	// copy the fields with the lengths found above
+	kputsn(f[col[old][1]], fl[col[old][1]], key); kputc('|', key); kputsn(f[col[old][3]], fl[col[old][3]], key);
+	if (col[old][0] < n) kputsn(f[col[old][0]], fl[col[old][0]], out);
+	else kputc('.', out);
+	for (j = 1; j < 9; ++j) {
+		kputc('\t', out);
+		if (j == 5 || j == 6) kputc(strcmp(f[col[old][j]], "0") == 0? '+' : '-', out); // strand: 0 forward, 16 reverse
+		else kputsn(f[col[old][j]], fl[col[old][j]], out);
 	}
-	ti_index_save(idx, fpidx);
-	ti_index_destroy(idx);
-	bgzf_close(fpidx);
-	free(fnidx);
 	return 0;
 }
 
-int ti_index_build(const char *fn, const ti_conf_t *conf)
-{
-	return ti_index_build2(fn, conf, 0);
+int ti_convert_merged_nodups(const char *fnin, const char *fnout, int old, const char **header, int nheader,
+                             const int *statcols, int nstatcols, int compress_level)
+{
+	static const char *pairs_header[] = { "## pairs format v1.0", "#sorted: chr1-chr2-pos1" };
+	static const char *columns = "#columns: readID chr1 pos1 chr2 pos2 strand1 strand2 frag1 frag2";
+	gzFile in;
+	ti_writer_t *w;
+	kstring_t str = {0, 0, 0}, buf = {0, 0, 0}, key = {0, 0, 0}, last = {0, 0, 0};
+	ti_mnd_line_t *a = 0;
+	size_t n = 0, m = 0;
+	uint64_t lineno = 0;
+	int i, r, pos, ret = 0;
+
+	in = ti_gzopen_input(fnin);
+	if (in == 0) return -1;
+	if ((w = ti_writer_open2(fnout, &ti_conf_pairs, statcols, nstatcols, compress_level)) == 0) {
+		gzclose(in);
+		return -2;
+	}
+	for (i = 0; i < 2 && ret == 0; ++i)
+		if (ti_writer_write(w, pairs_header[i], strlen(pairs_header[i])) < 0) ret = -2;
+	for (i = 0; i < nheader && ret == 0; ++i)
+		if (ti_writer_write(w, header[i], strlen(header[i])) < 0) ret = -2;
+	if (ret == 0 && ti_writer_write(w, columns, strlen(columns)) < 0) ret = -2;
+	// the file is sorted by chromosome pair, not always by pos1 in a pair: the lines of a pair are sorted before they are written
+	while (ret == 0) {
+		if ((r = ti_sort_getline(in, &str)) < 0) {
+			if (r == -3) ret = -3;
+			break;
+		}
+		++lineno;
+		if (str.l == 0 || str.s[0] == '#') continue;
+		if (n == m) {
+			m = m? m << 1 : 0x10000;
+			a = (ti_mnd_line_t*)realloc(a, m * sizeof(ti_mnd_line_t));
+		}
+		a[n].s = buf.l;
+		if (ti_mnd_convert(str.s, old, &buf, &key, &pos) < 0) {
+			fprintf(stderr, "[ti_convert_merged_nodups] line %llu can't be parsed.\n", (unsigned long long)lineno);
+			ret = -4;
+			break;
+		}
+		if (n > 0 && strcmp(key.s, last.s) != 0) { // a new pair: write the lines of the previous one
+			size_t s = a[n].s;
+			if (ti_mnd_flush(w, a, n, &buf) < 0) { ret = -5; break; }
+			memmove(buf.s, buf.s + s, buf.l - s);
+			buf.l -= s;
+			a[0].s = 0; n = 0;
+		}
+		if (n == 0) { last.l = 0; kputs(key.s, &last); }
+		a[n].l = buf.l - a[n].s;
+		a[n].pos = pos;
+		a[n++].i = lineno;
+		kputc(0, &buf);
+	}
+	if (ret == 0 && n > 0 && ti_mnd_flush(w, a, n, &buf) < 0) ret = -5;
+	gzclose(in);
+	free(str.s); free(buf.s); free(key.s); free(last.s); free(a);
+	if (ret != 0) { // no index, and no partial output
+		w->error = 1;
+		ti_writer_close(w, 0);
+		remove(fnout);
+	} else if (ti_writer_close(w, 0) < 0) ret = -6;
+	return ret;
 }
 
 /********************************************
@@ -851,6 +2608,66 @@ int ti_parse_region(const ti_index_t *idx, const char *str, int *tid, int *begin
 }
 
 
+/* parse 'beg-end' (1-based, inclusive; ',' is ignored) into a 0-based half-open interval.
+ * An empty string means the whole sequence; a missing end means up to the end of the sequence. */
+int ti_parse_pos(const char *str, int *begin, int *end)
+{
+	char *s;
+	int i, l, k;
+	l = strlen(str);
+	s = (char*)malloc(l+1);
+	for (i = k = 0; i != l; ++i)
+		if (str[i] != ',' && !isspace(str[i])) s[k++] = str[i];
+	s[k] = 0;
+	for (i = 0; i != k; ++i) if (s[i] == '-') break;
+	*begin = k? atoi(s) : 0;
+	*end = i + 1 < k? atoi(s + i + 1) : 1<<MAX_CHR;
+	if (*begin > 0) --*begin;
+	free(s);
+	return *begin > *end? -1 : 0;
+}
+
+/* resolve a wildcard region ('*|chr2:beg-end' or 'chr1:beg-end|*') to the tids of all matching chromosome pairs.
+ * *tids (owned by the index, in increasing order) and *n are set to the matching chromosome pairs, *wild to the mate
+ * given as '*' (1 or 2), and *begin, *end to the position range of the other mate.
+ * returns 1 for a wildcard region, 0 if reg has no wildcard, -1 if the positions are invalid. */
+int ti_parse_region_wildcard(const ti_index_t *idx, const char *reg, const int **tids, int *n, int *wild, int *begin, int *end)
+{
+	const ti_matemap_t *mm;
+	const char *sp, *mate, *colon;
+	char *chr;
+	int len;
+	khint_t k;
+	*tids = 0; *n = 0;
+	if ((sp = strchr(reg, idx->conf.region_split_character)) == 0) return 0;
+	if (sp == reg + 1 && reg[0] == '*') { *wild = 1; mate = sp + 1; len = strlen(mate); }
+	else if (strcmp(sp + 1, "*") == 0) { *wild = 2; mate = reg; len = sp - reg; }
+	else return 0;
+	if ((colon = memchr(mate, ':', len)) != 0) {
+		char *pos = (char*)malloc(len + 1);
+		int ret;
+		memcpy(pos, colon + 1, mate + len - colon - 1);
+		pos[mate + len - colon - 1] = 0;
+		ret = ti_parse_pos(pos, begin, end);
+		free(pos);
+		if (ret < 0) return -1;
+		len = colon - mate;
+	} else {
+		*begin = 0; *end = 1<<MAX_CHR;
+	}
+	mm = idx->matemap + (*wild == 1? 1 : 0); // the given mate
+	if (mm->h == 0) return 1;
+	chr = (char*)malloc(len + 1);
+	memcpy(chr, mate, len); chr[len] = 0;
+	k = kh_get(s, mm->h, chr);
+	free(chr);
+	if (k != kh_end(mm->h)) {
+		*tids = mm->tids[kh_value(mm->h, k)].tid;
+		*n = mm->tids[kh_value(mm->h, k)].n;
+	}
+	return 1;
+}
+
 // thie function can handle both 1d and 2d query automatically
 // if 1d, begin2 and end2 will have value -1.
 // query string error: -1
@@ -901,7 +2718,7 @@ int ti_parse_region2d(const ti_index_t *idx, const char *str, int *tid, int *beg
         s[i]=0; pos2s=i+1;
 
         /* concatenate chromosomes */
-        sname = (char*)malloc(l+1);
+        sname = (char*)malloc(k+1);
         strcpy(sname, s + coord1s);
         h=strlen(sname);
         sname[h]= region_split_character;
@@ -993,6 +2810,107 @@ uint64_t get_linecount(const ti_index_t *idx)
         return(idx->linecount);
 }
 
+int ti_get_max_pos(void)
+{
+        return(1<<MAX_CHR);
+}
+
+const ti_chunkstats_t *ti_get_chunkstats(const ti_index_t *idx)
+{
+        return(idx->chunkstats);
+}
+
+const ti_keystat_t *ti_get_keystats(const ti_index_t *idx)
+{
+        return(idx->keystats);
+}
+
+const ti_blocktable_t *ti_get_blocktable(const ti_index_t *idx)
+{
+        return(idx->blocks);
+}
+
+int ti_partition(const ti_index_t *idx, int n, int64_t *part)
+{
+	const ti_blocktable_t *bt = idx->blocks;
+	int i, k = 0;
+	if (bt == 0) return -1;
+	if (bt->n == 0 || n < 1) return 0;
+	part[k++] = 0;
+	for (i = 1; i < n; ++i) { // the entry nearest to the i-th n-quantile of the uncompressed bytes
+		uint64_t target = (uint64_t)((double)bt->ulen * i / n);
+		int64_t lo = 0, hi = bt->n, mid;
+		while (lo < hi) { // first entry at or after target
+			mid = (lo + hi) >> 1;
+			if (bt->uoff[mid] < target) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo == bt->n || (lo > 0 && target - bt->uoff[lo-1] < bt->uoff[lo] - target)) --lo;
+		if (lo > part[k-1]) part[k++] = lo;
+	}
+	part[k] = bt->n;
+	return k;
+}
+
+// the last entry of the block offset table at or before line <k>
+static int64_t blocktable_find_line(const ti_blocktable_t *bt, uint64_t k)
+{
+	int64_t lo = 0, hi = bt->n, mid;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (bt->line[mid] <= k) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo - 1;
+}
+
+int64_t ti_get_line_number(BGZF *fp, const ti_index_t *idx, uint64_t off)
+{
+	const ti_blocktable_t *bt = idx->blocks;
+	kstring_t str = {0, 0, 0};
+	int64_t lo = 0, hi, mid, k;
+	if (bt == 0) return -1;
+	if (bt->n == 0 || off >= bt->voff_end) return get_linecount(idx);
+	for (hi = bt->n; lo < hi; ) { // the last entry at or before off
+		mid = (lo + hi) >> 1;
+		if (bt->voff[mid] <= off) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0) return 0;
+	if (bgzf_seek(fp, bt->voff[lo-1], SEEK_SET) < 0) return -1;
+	for (k = bt->line[lo-1]; (uint64_t)bgzf_tell(fp) < off; ++k)
+		if (ti_readline(fp, &str) < 0) break;
+	free(str.s);
+	return k;
+}
+
+int64_t ti_read_rows(BGZF *fp, const ti_index_t *idx, const uint64_t *rows, int64_t n, void *data, ti_fetch_f func)
+{
+	const ti_blocktable_t *bt = idx->blocks;
+	kstring_t str = {0, 0, 0};
+	uint64_t cur = 0; // number of the next line of fp
+	int64_t i, b, n_read = 0;
+	int started = 0, ret = 0;
+	if (bt == 0) return -1;
+	for (i = 0; i < n && ret == 0; ++i) {
+		if ((b = blocktable_find_line(bt, rows[i])) < 0) break;
+		if (!started || cur > rows[i] || bt->line[b] > cur) { // jump to the block holding the row
+			if (bgzf_seek(fp, bt->voff[b], SEEK_SET) < 0) { ret = -2; break; }
+			cur = bt->line[b];
+			started = 1;
+		}
+		for (; cur <= rows[i]; ++cur) {
+			if (ti_readline(fp, &str) < 0) { ret = -1; break; }
+		}
+		if (ret == 0) {
+			func(str.l, str.s, data);
+			++n_read;
+		}
+	}
+	free(str.s);
+	return ret == -2? -2 : n_read;
+}
+
 
 ti_iter_t ti_iter_query(const ti_index_t *idx, int tid, int beg, int end, int beg2, int end2 ){ //beg2, end2 should be -1 for 1d query.
 	uint16_t *bins;
@@ -1067,6 +2985,32 @@ ti_iter_t ti_iter_query(const ti_index_t *idx, int tid, int beg, int end, int be
 }
 
 
+// if the record at the current offset starts in a block to be skipped, seek to the first record of the next block
+// that is not skipped, or to the end of the current chunk. returns 1 if the offset was moved.
+static int ti_iter_skip_blocks(BGZF *fp, ti_iter_t iter)
+{
+	const ti_chunkstats_t *cs = iter->idx->chunkstats;
+	uint64_t coff = iter->curr_off>>16, target;
+	int b = iter->skip_b;
+	if (b < 0 || b >= cs->nblocks || cs->coff[b] != coff) {
+		int lo = 0, hi = cs->nblocks;
+		while (lo < hi) { // the first block at or after coff
+			int mid = (lo + hi) >> 1;
+			if (cs->coff[mid] < coff) lo = mid + 1;
+			else hi = mid;
+		}
+		iter->skip_b = b = lo;
+		if (b == cs->nblocks || cs->coff[b] != coff) return 0; // no statistics for this block
+	}
+	if (!iter->skip[b]) return 0;
+	while (b < cs->nblocks && iter->skip[b]) ++b;
+	target = b < cs->nblocks && cs->first[b] < iter->off[iter->i].v? cs->first[b] : iter->off[iter->i].v;
+	bgzf_seek(fp, target, SEEK_SET);
+	iter->curr_off = target;
+	iter->skip_b = b;
+	return 1;
+}
+
 const char *ti_iter_read(BGZF *fp, ti_iter_t iter, int *len, char seqonly)
 {
         if (!iter) return 0;
@@ -1093,6 +3037,7 @@ const char *ti_iter_read(BGZF *fp, ti_iter_t iter, int *len, char seqonly)
 			}
 			++iter->i;
 		}
+		if (iter->skip && ti_iter_skip_blocks(fp, iter)) continue;
 		if ((ret = ti_readline(fp, &iter->str)) >= 0) {
 			iter->curr_off = bgzf_tell(fp);
 			if (iter->str.s[0] == iter->idx->conf.meta_char) continue;
@@ -1113,6 +3058,80 @@ const char *ti_iter_read(BGZF *fp, ti_iter_t iter, int *len, char seqonly)
 	return 0;
 }
 
+void ti_iter_set_skip(ti_iter_t iter, const uint8_t *skip)
+{
+	if (iter && iter->idx->chunkstats) {
+		iter->skip = skip;
+		iter->skip_b = -1;
+	}
+}
+
+void ti_iter_get_pos(ti_iter_t iter, int *i, uint64_t *off)
+{
+	*i = iter->i; *off = iter->curr_off;
+}
+
+int ti_iter_set_pos(BGZF *fp, ti_iter_t iter, int i, uint64_t off)
+{
+	if (iter->from_first || i < -1 || i >= iter->n_off) return -1;
+	if (i >= 0 && (off < iter->off[i].u || off > iter->off[i].v)) return -1; // not in the chunk
+	if (i < 0) off = 0; // before the first chunk
+	else if (bgzf_seek(fp, off, SEEK_SET) < 0) return -1;
+	iter->i = i; iter->curr_off = off; iter->skip_b = -1;
+	return 0;
+}
+
+int ti_iter_sample_blocks(ti_iter_t iter, int n, int64_t *n_total)
+{
+	const ti_blocktable_t *bt;
+	pair64_t *seg;
+	int64_t n_seg = 0, m_seg, b, j;
+	int i;
+	*n_total = iter? iter->n_off : 0;
+	if (!iter || iter->n_off == 0 || n < 1) return *n_total;
+	bt = iter->idx->blocks;
+	// split the chunks at the first line of each block : a segment holds the records of the chunk starting in one block
+	m_seg = iter->n_off;
+	seg = (pair64_t*)malloc(m_seg * 16);
+	for (i = 0; i < iter->n_off; ++i) {
+		uint64_t u = iter->off[i].u, v = iter->off[i].v, e;
+		b = bt? bt->n : 0;
+		if (bt) { // the first entry after u
+			int64_t lo = 0, hi = bt->n, mid;
+			while (lo < hi) {
+				mid = (lo + hi) >> 1;
+				if (bt->voff[mid] <= u) lo = mid + 1;
+				else hi = mid;
+			}
+			b = lo;
+		}
+		for (; u < v; u = e) {
+			e = bt && b < bt->n && bt->voff[b] < v? bt->voff[b++] : v;
+			if (n_seg == m_seg) {
+				m_seg <<= 1;
+				seg = (pair64_t*)realloc(seg, m_seg * 16);
+			}
+			seg[n_seg].u = u; seg[n_seg++].v = e;
+		}
+	}
+	*n_total = n_seg;
+	if (n_seg <= n) { // all blocks fit in the budget
+		free(seg);
+		return n_seg;
+	}
+	for (j = 0; j < n; ++j) // the middle segment of each of n equal parts
+		seg[j] = seg[(2 * j + 1) * n_seg / (2 * n)];
+	free(iter->off);
+	iter->off = (pair64_t*)realloc(seg, n * 16);
+	iter->n_off = n;
+	return n;
+}
+
+const ti_intv_t *ti_iter_get_intv(ti_iter_t iter)
+{
+	return iter? &iter->intv : 0;
+}
+
 void ti_iter_destroy(ti_iter_t iter)
 {
 	if (iter) {
@@ -1198,83 +3217,21 @@ int ti_lazy_index_load(pairix_t *t)
 // reg can contain wildcard for one of the two mates ('*')
 sequential_iter_t *ti_querys_2d_general(pairix_t *t, const char *reg)
 {
-   int n_seqpair_list;
-   int n_sub_list;
-   char *sp, **chr1list, **chr2list;
-   char *chrend;
-   char chronly=1;
-   int i;
-
-   char region_split_character = t->idx->conf.region_split_character;
-
-   if((sp = strchr(reg, region_split_character)) != NULL){
-      if(sp == reg + 1 && reg[0]=='*') {    // '*|c:s-e'
-         char *chr2 = sp + 1;
-
-         // get the second chromosome and the list of the first chromosomes pairing with the second chromosome.
-         // extract only chr part temporarily (split the beg and end part for now)
-         if( (chrend = strchr(chr2, ':')) != NULL) {
-            *chrend=0; chronly=0;
-         }
-         char **chrpairlist = ti_seqname(t->idx, &n_seqpair_list);
-         chr1list = get_seq1_list_for_given_seq2(chr2, chrpairlist, n_seqpair_list, &n_sub_list);
-         if(chronly==0) *chrend=':';  // revert to original region string including beg and end
-         // create an array of regions in string.
-         char **regions = malloc(n_sub_list * sizeof(char*));
-         for(i=0;i<n_sub_list;i++){
-            regions[i] = malloc((strlen(chr1list[i]) + strlen(chr2) + 2) * sizeof(char));
-            strcpy(regions[i], chr1list[i]);
-            *(regions[i] + strlen(regions[i]) + 1) = 0;
-            *(regions[i] + strlen(regions[i])) = region_split_character;
-            strcat(regions[i], chr2);
-         }
-         free(chrpairlist);
-         for(i=0;i<n_sub_list;i++) free(chr1list[i]);
-         free(chr1list);
-
-         // multi-region query
-         sequential_iter_t *siter = ti_querys_2d_multi(t, regions, n_sub_list);
-         for(i=0;i<n_sub_list;i++) free(regions[i]);
-         free(regions);
-         return(siter);
-
-      } else if(strlen(sp) == 2 && sp[1]=='*'){  // 'c:s-e|*'
-         *sp=0; char *chr1 = reg;
-         if( (chrend = strchr(chr1, ':')) != NULL) {
-            *chrend=0; chronly=0;
-         }
-         char **chrpairlist = ti_seqname(t->idx, &n_seqpair_list);
-         chr2list = get_seq2_list_for_given_seq1(chr1, chrpairlist, n_seqpair_list, &n_sub_list);
-         if(chronly==0) *chrend=':';  // revert to original region string including beg and end
-
-         // create an array of regions in string.
-         char **regions = malloc(n_sub_list * sizeof(char*));
-         for(i=0;i<n_sub_list;i++){
-            regions[i] = malloc((strlen(chr2list[i]) + strlen(chr1) + 2) * sizeof(char));
-            strcpy(regions[i], chr1);
-            *(regions[i] + strlen(regions[i]) + 1) = 0;
-            *(regions[i] + strlen(regions[i])) = region_split_character;
-            strcat(regions[i], chr2list[i]);
-         }
-         free(chrpairlist);
-         for(i=0;i<n_sub_list;i++) free(chr2list[i]);
-         free(chr2list);
-
-         sequential_iter_t *siter = ti_querys_2d_multi(t, regions, n_sub_list);
-         for(i=0;i<n_sub_list;i++) free(regions[i]);
-         free(regions);
-         return(siter);
-
-      } else {  // no wildcard
-         sequential_iter_t *siter = create_sequential_iter(t);
-         add_to_sequential_iter ( siter, ti_querys_2d(t,reg) );
-         return(siter);
+   const int *tids;
+   int n, wild, beg, end, i, res;
+   sequential_iter_t *siter = create_sequential_iter(t);
+
+   if (ti_lazy_index_load(t) != 0) return(siter);
+   res = ti_parse_region_wildcard(t->idx, reg, &tids, &n, &wild, &beg, &end);
+   if (res == 0) {  // no wildcard (or 1d query)
+      add_to_sequential_iter ( siter, ti_querys_2d(t,reg) );
+   } else if (res > 0) {  // '*|c:s-e' or 'c:s-e|*' : one iterator per matching chromosome pair
+      for(i=0;i<n;i++){
+         if(wild == 1) add_to_sequential_iter ( siter, ti_iter_query(t->idx, tids[i], 0, 1<<MAX_CHR, beg, end) );
+         else add_to_sequential_iter ( siter, ti_iter_query(t->idx, tids[i], beg, end, 0, 1<<MAX_CHR) );
       }
-   }else {  // 1d query (let's regard it as 1d query on 1d index for now)
-         sequential_iter_t *siter = create_sequential_iter(t);
-         add_to_sequential_iter ( siter, ti_querys_2d(t,reg) );
-         return(siter);
    }
+   return(siter);
 }
 
 
@@ -1739,19 +3696,25 @@ char **get_seq1_list_for_given_seq2(char *seq2, char **seqpair_list, int n_seqpa
     return(sublist);
 }
 
-/* convert string 'region1|region2' to 'region2|region1' */
+/* convert string 'region1|region2' to 'region2|region1'.
+ * The returned string is a static buffer that is overwritten by the next call.
+ * A string without region_split_character is returned as is. */
 char *flip_region ( char* s, char region_split_character) {
-    char s_flp[MAX_REGION_STR_LEN];
-    int l, i, l2, split_pos;
+    static char s_flp[MAX_REGION_STR_LEN];
+    int l, i, l2;
     l = strlen(s);
+    if (l >= MAX_REGION_STR_LEN) l = MAX_REGION_STR_LEN - 1;
     for(i = 0; i != l; i++) if( s[i] == region_split_character) break;
-    s[i]=0;
-    split_pos = i;
+    if (i == l) {
+        memcpy(s_flp, s, l);
+        s_flp[l] = 0;
+        return(s_flp);
+    }
     l2 = l-1-i;
-    strcpy(s_flp, s + i + 1);
+    memcpy(s_flp, s + i + 1, l2);
     s_flp[l2] = region_split_character;
-    strcpy(s_flp + l2 + 1, s);
-    s[i]= region_split_character;
+    memcpy(s_flp + l2 + 1, s, i);
+    s_flp[l] = 0;
     return(s_flp);
 }
 
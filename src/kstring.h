@@ -35,7 +35,7 @@ static inline int kputsn(const char *p, int l, kstring_t *s)
 		kroundup32(s->m);
 		s->s = (char*)realloc(s->s, s->m);
 	}
-	strncpy(s->s + s->l, p, l);
+	memcpy(s->s + s->l, p, l);
 	s->l += l;
 	s->s[s->l] = 0;
 	return l;
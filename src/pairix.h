@@ -33,6 +33,7 @@
 #include <stdint.h>
 #include "kstring.h"
 #include "bgzf.h"
+#include "pairix_apply.h"  // ti_index_t, ti_intv_t and ti_accumulator_t (inst/include)
 
 #define DEFAULT_REGION_SPLIT_CHARACTER   '|'
 #define DEFAULT_REGION_SPLIT_CHARACTER_STR  "|"
@@ -48,12 +49,15 @@
 
 typedef int (*ti_fetch_f)(int l, const char *s, void *data);
 
-struct __ti_index_t;
-typedef struct __ti_index_t ti_index_t;
-
 struct __ti_iter_t;
 typedef struct __ti_iter_t *ti_iter_t;
 
+struct __ti_indexer_t;
+typedef struct __ti_indexer_t ti_indexer_t;
+
+struct __ti_writer_t;
+typedef struct __ti_writer_t ti_writer_t;
+
 typedef struct {
 	BGZF *fp;
 	ti_index_t *idx;
@@ -77,8 +81,36 @@ typedef struct {
 } ti_interval_t;
 
 typedef struct {
-        int tid, beg, end, bin, beg2, end2, bin2;
-} ti_intv_t;
+        uint64_t n;  // number of records
+        int32_t beg, end;  // smallest start and largest end of the first coordinate (0-based, half-open)
+        int32_t beg2, end2;  // same for the second coordinate (INT32_MAX and -1 for 1D)
+        uint64_t off_beg, off_end;  // virtual file offsets of the first record and right after the last record
+        uint64_t ulen;  // uncompressed bytes spanned by the records, including newlines
+} ti_keystat_t;
+
+#define TI_CHUNKSTAT_MAX_DICT 64
+
+/* per-block column statistics, for the BGZF blocks in which records start (sorted by offset).
+ * min, max and bits are indexed by [block * ncols + column]. */
+typedef struct {
+        int32_t ncols, nblocks;
+        int32_t *col;  // 0-based column index of each statistics column
+        int32_t *ndict;  // number of distinct values of each column; -1 if there were more than TI_CHUNKSTAT_MAX_DICT
+        char ***dict;  // distinct values of each column
+        uint64_t *coff;  // compressed offset of each block
+        uint64_t *first;  // virtual offset of the first record starting in each block
+        double *min, *max;  // numeric range of the fields of the records starting in the block (min > max if none is numeric)
+        uint64_t *bits;  // set of the values (bit k for dict[column][k]) of the records starting in the block
+} ti_chunkstats_t;
+
+/* line-aligned block offset table: for each BGZF block in which a line starts (sorted by offset), the virtual offset
+ * of the first line starting in the block, its uncompressed offset in the file and the number of lines before it. */
+typedef struct {
+        int64_t n, m;
+        uint64_t *voff, *uoff, *line;
+        uint64_t ulen;  // uncompressed length of the file (lines, including newlines)
+        uint64_t voff_end;  // virtual offset right after the last line
+} ti_blocktable_t;
 
 typedef struct {
     pairix_t *t;
@@ -150,9 +182,58 @@ extern "C" {
 	 * calling this function. The number of sequences is returned at *n. */
 	const char **ti_seqname(const ti_index_t *idx, int *n);
 
+        /* Get the tids (in increasing order) of the chromosome pairs whose mate1 (mate=1) or mate2 (mate=2)
+         * chromosome is chr. The array is owned by the index. Returns NULL (and *n=0) if there is none. */
+        const int *ti_get_mate_tids(const ti_index_t *idx, int mate, const char *chr, int *n);
+
+        /* Get the unique mate1 (mate=1) or mate2 (mate=2) chromosome names, in the order they first appear.
+         * The array is owned by the index. For a 1D index, the sequence names are the mate1 names. */
+        const char **ti_get_mate_names(const ti_index_t *idx, int mate, int *n);
+
         /* get linecount */
         uint64_t get_linecount(const ti_index_t *idx);
 
+        /* largest position that can be queried (used as the end of an open-ended region) */
+        int ti_get_max_pos(void);
+
+        /* get per-key (chromosome pair) statistics, indexed by tid.
+         * returns NULL if the index was built by an older version that does not store them. */
+        const ti_keystat_t *ti_get_keystats(const ti_index_t *idx);
+
+        /* get per-block column statistics. returns NULL if they were not requested when the index was built. */
+        const ti_chunkstats_t *ti_get_chunkstats(const ti_index_t *idx);
+
+        /* get the block offset table. returns NULL if the index was built by an older version that does not store it. */
+        const ti_blocktable_t *ti_get_blocktable(const ti_index_t *idx);
+
+        /* split the file of <idx> into at most <n> line-aligned ranges of about the same uncompressed size, at block
+         * offset table entries. The start of range i is entry part[i], and its end is entry part[i+1] (the end of the
+         * file if part[i+1] is the number of entries). Returns the number of ranges (0 for an empty file), or -1 if
+         * the index has no block offset table. <part> must have room for n + 1 values. */
+        int ti_partition(const ti_index_t *idx, int n, int64_t *part);
+
+        /* number (0-based, header lines included) of the line starting at virtual offset <off>, from the block offset table
+         * and by reading from the first line starting in its block. Returns -1 if the index has no block offset table. */
+        int64_t ti_get_line_number(BGZF *fp, const ti_index_t *idx, uint64_t off);
+
+        /* read the lines numbered <rows> (0-based, header lines included, in increasing order) and call <func> on each,
+         * inflating only the blocks that hold them, found with the block offset table. Rows past the end of the file are
+         * ignored. Returns the number of lines read, -1 if the index has no block offset table and -2 on a read error. */
+        int64_t ti_read_rows(BGZF *fp, const ti_index_t *idx, const uint64_t *rows, int64_t n, void *data, ti_fetch_f func);
+
+        /* call <func> on each line whose read name (the column of ti_index_reads) is one of <ids>, in file order, reading
+         * only the blocks that the read name index lists for their hashes. Returns the number of lines found, -1 if the
+         * index has no read name index and -2 on a read error. */
+        int64_t ti_lookup_reads(BGZF *fp, const ti_index_t *idx, const char **ids, int n, void *data, ti_fetch_f func);
+
+        /* scan all the data lines of the file <fn> indexed by <idx> on <n_threads> threads, each with its own file handle and
+         * partial result of <acc>. The file is split into line-aligned ranges of blocks with ti_partition (a few per thread),
+         * taken by the threads as they become free; the partial results are merged in thread order into *result, to be freed
+         * with acc->destroy. Lines whose key is not in the index are skipped. Returns 0 on success, -1 if the index has no
+         * block offset table, -2 if the file can't be opened or read and -3 if acc->add stopped the scan (*result is then NULL).
+         * Other R packages call it as Rpairix_apply, declared in inst/include/Rpairix.h. */
+        int ti_apply(const char *fn, const ti_index_t *idx, int n_threads, const ti_accumulator_t *acc, void *arg, void **result);
+
         /* get file offset
          * returns number of bgzf blocks spanning a sequence (pair) */
         int get_nblocks(ti_index_t *idx, int tid, BGZF *fp);
@@ -175,6 +256,66 @@ extern "C" {
 	 * and overwrite the file of the same name. Return -1 on failure. */
 	int ti_index_build(const char *fn, const ti_conf_t *conf);
 
+	/* Same as ti_index_build, and also store per-block statistics for the given columns (0-based). */
+	int ti_index_build3(const char *fn, const ti_conf_t *conf, const char *_fnidx, const int *statcols, int nstatcols);
+
+	/* Same as ti_index_build3, with <n_threads> threads decompressing and parsing the file (the index is the same). */
+	int ti_index_build4(const char *fn, const ti_conf_t *conf, const char *_fnidx, const int *statcols, int nstatcols, int n_threads);
+
+	/* Build an index line by line. <beg> and <end> are the virtual file offsets of the line and of the next line.
+	 * ti_indexer_add returns -1 on failure (unsorted file or unparsable line). ti_indexer_finish frees the indexer
+	 * and returns the index; <end> is the offset after the last line. */
+	ti_indexer_t *ti_indexer_init(const ti_conf_t *conf, const int *statcols, int nstatcols, uint64_t off0);
+	int ti_indexer_add(ti_indexer_t *ix, kstring_t *str, uint64_t beg, uint64_t end);
+	ti_index_t *ti_indexer_finish(ti_indexer_t *ix, uint64_t end);
+	void ti_indexer_destroy(ti_indexer_t *ix);
+
+	/* Write a bgzipped file <fn> and build its index in the same pass. ti_writer_copy copies the lines of <fp>
+	 * between the virtual offsets <beg> and <end>; the blocks entirely in the range are not recompressed.
+	 * ti_writer_close saves the index to <fnidx> (<fn>.px2 if NULL). Return -1 on failure. ti_writer_open2 sets the
+	 * compression level (-1 for the default); if <conf> is NULL, the file is written without an index. */
+	ti_writer_t *ti_writer_open(const char *fn, const ti_conf_t *conf, const int *statcols, int nstatcols);
+	ti_writer_t *ti_writer_open2(const char *fn, const ti_conf_t *conf, const int *statcols, int nstatcols, int compress_level);
+	int ti_writer_write(ti_writer_t *w, const char *s, int len);
+	int ti_writer_copy(ti_writer_t *w, BGZF *fp, uint64_t beg, uint64_t end);
+	int ti_writer_close(ti_writer_t *w, const char *fnidx);
+
+	/* Compress the sorted text file <fnin> ("-" for the standard input) into <fnout> with bgzf_compress_file2 and
+	 * build the index of <fnout> from the written blocks in the same pass. Return 0 on success, the return value
+	 * of bgzf_compress_file2 on failure, -5 if the file can't be indexed and -6 if the index can't be written. */
+	int ti_index_bgzip(const char *fnin, const char *fnout, const ti_conf_t *conf, const char *_fnidx, const int *statcols, int nstatcols, int compress_level, int n_threads);
+
+	/* Update the index of <fn> (<_fnidx>, or <fn>.px2 if NULL) for lines appended to the file after its last indexed line,
+	 * reading only these lines. Their keys must not be in the index yet. The number of new lines is stored in <n_lines>
+	 * (if not NULL). Return 0 on success, -1 if the file or its index can't be opened, -2 if the index has no key
+	 * statistics, -3 if the indexed data has changed, -4 if an end-of-file block is left before the new lines,
+	 * -5 if the new lines can't be indexed and -6 if the index can't be written. */
+	int ti_index_update(const char *fn, const char *_fnidx, uint64_t *n_lines);
+
+	/* Add to the index of <fn> (<_fnidx>, or <fn>.px2 if NULL) a secondary index on the read names in column <col>
+	 * (0-based; -1 for the read name of the preset : the last column of merged_nodups, the first column otherwise): the
+	 * sorted 32-bit hashes of the read names, each with the block (entry of the block offset table) holding the line.
+	 * It is kept up to date by ti_index_update. Return the number of entries, -1 if the file or its index can't be opened,
+	 * -2 if the index has no block offset table, -3 on a read error and -4 if the index can't be written. */
+	int64_t ti_index_reads(const char *fn, const char *_fnidx, int col);
+
+	/* Sort the text file <fnin> (plain or gzip; "-" for the standard input) in the order required by the index of <conf>
+	 * (sequence name or pair, then start) and write it to the bgzipped file <fnout> with its index. Runs of at most <max_mem>
+	 * bytes are sorted on <n_threads> threads, spilled to temporary BGZF files in <tmpdir> and merged. Header lines come first.
+	 * Return 0 on success, -1 if <fnin> can't be opened, -2 on a write error, -3 on a read error, -5 if a line can't be
+	 * parsed and -6 if the index can't be written. */
+	int ti_sort_file(const char *fnin, const char *fnout, const ti_conf_t *conf, const char *_fnidx, const int *statcols, int nstatcols,
+	                 size_t max_mem, const char *tmpdir, int compress_level, int n_threads);
+
+	/* Convert the Juicer merged_nodups file <fnin> (plain or gzip; "-" for the standard input; old_merged_nodups if <old>)
+	 * into the bgzipped pairs file <fnout> (columns readID chr1 pos1 chr2 pos2 strand1 strand2 frag1 frag2) and index it
+	 * in the same pass. The lines must be grouped by chromosome pair; the lines of a pair are sorted by pos1 in memory.
+	 * <header> lines are written after the '## pairs format' and '#sorted' lines. Return 0 on success, -1 if <fnin> can't
+	 * be opened, -2 on a write error, -3 on a read error, -4 if a line can't be parsed, -5 if the lines can't be indexed
+	 * (pairs not grouped) and -6 if the index can't be written. */
+	int ti_convert_merged_nodups(const char *fnin, const char *fnout, int old, const char **header, int nheader,
+	                             const int *statcols, int nstatcols, int compress_level);
+
 	/* Load the index from file <fn>.px2. If <fn> is a URL and the index
 	 * file is not in the working directory, <fn>.px2 will be
 	 * downloaded. Return NULL on failure. */
@@ -189,6 +330,13 @@ extern "C" {
 	int ti_parse_region(const ti_index_t *idx, const char *str, int *tid, int *begin, int *end);
 	int ti_parse_region2d(const ti_index_t *idx, const char *str, int *tid, int *begin, int *end, int *begin2, int *end2);
 
+	/* Parse a position range like: 100-200, 100 or an empty string. Return -1 on failure. */
+	int ti_parse_pos(const char *str, int *begin, int *end);
+
+	/* Resolve a wildcard region like: *|chr2:100-200 or chr1:100-200|* to the tids of the matching chromosome pairs.
+	 * Return 1 for a wildcard region, 0 if there is no wildcard and -1 on failure. */
+	int ti_parse_region_wildcard(const ti_index_t *idx, const char *reg, const int **tids, int *n, int *wild, int *begin, int *end);
+
 	int ti_get_tid(const ti_index_t *idx, const char *name);
 
 	/* Get the iterator pointing to the first record at the current file
@@ -202,6 +350,26 @@ extern "C" {
 	/* Get the data line pointed by the iterator and iterate to the next record. */
 	const char *ti_iter_read(BGZF *fp, ti_iter_t iter, int *len, char seqonly);
 
+	/* Get the interval (tid and positions) of the line last returned by ti_iter_read. */
+	const ti_intv_t *ti_iter_get_intv(ti_iter_t iter);
+
+	/* Skip the records starting in the blocks flagged in skip (one flag per block of ti_get_chunkstats).
+	 * skip must stay valid while the iterator is used. No effect if the index has no block statistics. */
+	void ti_iter_set_skip(ti_iter_t iter, const uint8_t *skip);
+
+	/* Get the position of the iterator (chunk index and virtual offset of the next record). */
+	void ti_iter_get_pos(ti_iter_t iter, int *i, uint64_t *off);
+
+	/* Move an iterator to a position returned by ti_iter_get_pos on an iterator over the same region.
+	 * Return 0 on success, -1 if the position is not valid for this iterator. */
+	int ti_iter_set_pos(BGZF *fp, ti_iter_t iter, int i, uint64_t off);
+
+	/* Restrict a region iterator to at most n of the blocks its chunks cover, evenly spread over the chunks, so that only
+	 * those blocks are inflated. The number of blocks covered is stored in n_total. Without a block offset table
+	 * (ti_get_blocktable), whole chunks are sampled instead of blocks. Must be called before the iterator is read.
+	 * Return the number of blocks (chunks) kept. */
+	int ti_iter_sample_blocks(ti_iter_t iter, int n, int64_t *n_total);
+
 	const ti_conf_t *ti_get_conf(ti_index_t *idx);
 
         /* get column index, 0-based */
@@ -219,7 +387,8 @@ extern "C" {
 
 	int ti_get_intv(const ti_conf_t *conf, int len, char *line, ti_interval_t *intv);
 
-        /* convert string 'region1|region2' to 'region2|region1' */
+        /* convert string 'region1|region2' to 'region2|region1'.
+         * the returned string is overwritten by the next call. */
         char* flip_region(char *s, char region_split_character);
 
         /* create an empty merge_iter_t struct */
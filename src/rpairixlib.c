@@ -1,7 +1,13 @@
 #include "pairix.h"
+#include "khash.h"
 #include <sys/stat.h>
+#include <ctype.h>
 #include <R.h>
 #include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+
+KHASH_MAP_INIT_INT64(id, int)
+KHASH_MAP_INIT_STR(key, int)
 
 // load
 pairix_t *load(char* fn){
@@ -20,6 +26,141 @@ pairix_t *load(char* fn){
 }
 
 
+#define MAX_SWAP_COLS 16
+
+// lines collected from a query before being converted to R vectors.
+// the lines are stored back-to-back (null-terminated) in buf, starting at offset[i].
+typedef struct {
+  kstring_t buf;
+  size_t *offset;
+  int n, m;
+} linebuf_t;
+
+// reserve room for a line of length len at the end of the buffer and return a pointer to it.
+static char *linebuf_alloc(linebuf_t *lb, int len){
+  if(lb->n == lb->m){
+    lb->m = lb->m ? lb->m<<1 : 1024;
+    lb->offset = realloc(lb->offset, lb->m * sizeof(size_t));
+  }
+  if(lb->buf.l + len + 1 > lb->buf.m){
+    lb->buf.m = lb->buf.l + len + 1;
+    kroundup32(lb->buf.m);
+    lb->buf.s = realloc(lb->buf.s, lb->buf.m);
+  }
+  char *d = lb->buf.s + lb->buf.l;
+  lb->offset[lb->n++] = lb->buf.l;
+  lb->buf.l += len;
+  lb->buf.s[lb->buf.l++] = 0;
+  return(d);
+}
+
+static void linebuf_add(linebuf_t *lb, const char *s, int len){
+  memcpy(linebuf_alloc(lb, len), s, len);
+}
+
+// add a line with its first nperm columns reordered so that column j is taken from column perm[j].
+// lines with fewer than nperm columns are added as is.
+static void linebuf_add_permuted(linebuf_t *lb, const char *s, int len, char delimiter, const int *perm, int nperm){
+  int fb[MAX_SWAP_COLS], fe[MAX_SWAP_COLS], i, j=0, p=0;
+  for(i=0;i<=len && j<nperm;i++)
+    if(i==len || s[i]==delimiter) { fb[j]=p; fe[j++]=i; p=i+1; }
+  if(j<nperm) { linebuf_add(lb, s, len); return; }
+  char *d = linebuf_alloc(lb, len);
+  for(j=0;j<nperm;j++){
+    if(j>0) *d++ = delimiter;
+    memcpy(d, s + fb[perm[j]], fe[perm[j]] - fb[perm[j]]);
+    d += fe[perm[j]] - fb[perm[j]];
+  }
+  memcpy(d, s + fe[nperm-1], len - fe[nperm-1]);
+}
+
+static void linebuf_destroy(linebuf_t *lb){
+  free(lb->buf.s); free(lb->offset);
+}
+
+// convert collected lines into a list of character columns named V1, V2, ... (the number of columns is taken from the first line;
+// missing fields are NA, extra fields are dropped). If nsel > 0, only the columns sel[0..nsel-1] (0-based, in that order) are
+// returned and lines are tokenized only up to the last selected column. The returned object is not protected.
+static SEXP linebuf_to_columns(linebuf_t *lb, char delimiter, const int *sel, int nsel){
+  int i, j, ncols=0, maxsel=-1;
+  if(nsel > 0){
+    ncols = nsel;
+    for(j=0;j<nsel;j++) if(sel[j] > maxsel) maxsel = sel[j];
+  }
+  else if(lb->n > 0){
+    const char *s = lb->buf.s + lb->offset[0];
+    for(ncols=1; *s; s++) if(*s==delimiter) ncols++;
+  }
+  SEXP _r_pcols, _r_pnames;
+  PROTECT(_r_pcols = allocVector(VECSXP, ncols));
+  PROTECT(_r_pnames = NEW_CHARACTER(ncols));
+  for(j=0;j<ncols;j++){
+    char name[16];
+    sprintf(name, "V%d", (nsel > 0 ? sel[j] : j)+1);
+    SET_STRING_ELT(_r_pnames, j, mkChar(name));
+    SET_VECTOR_ELT(_r_pcols, j, NEW_CHARACTER(lb->n));
+  }
+  setAttrib(_r_pcols, R_NamesSymbol, _r_pnames);
+  if(nsel > 0){
+    int *fb = (int*)R_alloc(maxsel+1, sizeof(int)), *fe = (int*)R_alloc(maxsel+1, sizeof(int));
+    for(i=0;i<lb->n;i++){
+      const char *s = lb->buf.s + lb->offset[i];
+      int k=0, p=0, m;
+      for(m=0;k<=maxsel;m++){
+        if(s[m]==delimiter || s[m]==0){
+          fb[k] = p; fe[k++] = m; p = m+1;
+          if(s[m]==0) break;
+        }
+      }
+      for(j=0;j<nsel;j++)
+        SET_STRING_ELT(VECTOR_ELT(_r_pcols, j), i, sel[j] < k ? mkCharLen(s + fb[sel[j]], fe[sel[j]] - fb[sel[j]]) : NA_STRING);
+    }
+    UNPROTECT(2);
+    return(_r_pcols);
+  }
+  for(i=0;i<lb->n;i++){
+    const char *s = lb->buf.s + lb->offset[i], *start = s;
+    for(j=0;j<ncols;s++){
+      if(*s==delimiter || *s==0){
+        SET_STRING_ELT(VECTOR_ELT(_r_pcols, j++), i, mkCharLen(start, s - start));
+        if(*s==0) break;
+        start = s+1;
+      }
+    }
+    for(;j<ncols;j++) SET_STRING_ELT(VECTOR_ELT(_r_pcols, j), i, NA_STRING);
+  }
+  UNPROTECT(2);
+  return(_r_pcols);
+}
+
+// map each element of a character or factor vector to an integer code (0-based) and return the corresponding
+// unique names (levels). NA elements get code -1. The returned object is not protected.
+static SEXP chr_codes(SEXP _r_pchr, int *codes){
+  int i, n = length(_r_pchr);
+  if(isFactor(_r_pchr)){
+    int *pcodes = INTEGER(_r_pchr);
+    for(i=0;i<n;i++) codes[i] = pcodes[i]==NA_INTEGER ? -1 : pcodes[i]-1;
+    return(getAttrib(_r_pchr, R_LevelsSymbol));
+  }
+  // character vector : identical strings share the same CHARSXP, so the pointer can be used as the key
+  khash_t(id) *h = kh_init(id);
+  int ret, nlevels=0;
+  khint_t k;
+  for(i=0;i<n;i++){
+    SEXP c = STRING_ELT(_r_pchr, i);
+    if(c == NA_STRING) { codes[i] = -1; continue; }
+    k = kh_put(id, h, (uint64_t)(uintptr_t)c, &ret);
+    if(ret) kh_value(h, k) = nlevels++;
+    codes[i] = kh_value(h, k);
+  }
+  SEXP _r_plevels = NEW_CHARACTER(nlevels);
+  for(k = kh_begin(h); k != kh_end(h); ++k)
+    if(kh_exist(h, k)) SET_STRING_ELT(_r_plevels, kh_value(h, k), (SEXP)(uintptr_t)kh_key(h, k));
+  kh_destroy(id, h);
+  return(_r_plevels);
+}
+
+
 //get number of seq(chr)pairs
 void get_keylist_size(char** pfn, int *pn, int* pmax_key_len, int* pflag){
   int len;
@@ -53,14 +194,64 @@ void get_keylist(char** pfn, char** pkeylist, int* pflag){
   else *pflag = -1; // error
 }
 
-//check if a key (chr for 1D, chr pair for 2D) exists
-void key_exists(char** pfn, char** pkey, int* pflag){
+//.Call-compatible
+//get the list of unique mate1 or mate2 chromosomes, from the chromosome maps of the loaded index
+//input:
+//  _r_pfn : input filename (a single character string)
+//  _r_pmate : 1 for mate1, 2 for mate2
+//output is a character vector of chromosomes (NULL if the file can't be opened)
+SEXP get_mate_list(SEXP _r_pfn, SEXP _r_pmate){
+
+   // file name
+   char *pfn[1];
+   PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
+   pfn[0] = R_alloc(strlen(CHAR(STRING_ELT(_r_pfn, 0)))+1, sizeof(char));
+   strcpy(pfn[0], CHAR(STRING_ELT(_r_pfn, 0)));
+
+   int n=0, i;
+   const char **names;
+   pairix_t *tb = load(*pfn);
+   if(!tb || !tb->idx) { if(tb) ti_close(tb); UNPROTECT(1); return(R_NilValue); }
+   names = ti_get_mate_names(tb->idx, asInteger(_r_pmate), &n);
+   SEXP _r_pnames;
+   PROTECT(_r_pnames = NEW_CHARACTER(n));
+   for(i=0;i<n;i++) SET_STRING_ELT(_r_pnames, i, mkChar(names[i]));
+   ti_close(tb);
+   UNPROTECT(2);
+   return(_r_pnames);
+}
+
+//check if keys (chr for 1D, chr pair for 2D) exist, all against a single loaded index
+//pflag must have *pnkey elements; pflag[i] is 1 if pkey[i] exists, 0 if not. pflag[0] is -1 on error.
+void key_exists(char** pfn, char** pkey, int* pnkey, int* pflag){
+  int i;
   pairix_t *tb = load(*pfn);
-  if(tb){
-    *pflag = ti_get_tid(tb->idx, *pkey)!=-1?1:0;
-    ti_close(tb);
+  if(tb && tb->idx){
+    for(i=0;i<*pnkey;i++) pflag[i] = ti_get_tid(tb->idx, pkey[i])!=-1?1:0;
   }
-  else *pflag= -1;
+  else pflag[0]= -1;
+  if(tb) ti_close(tb);
+}
+
+//same as key_exists, but each key is given as a pair of chromosomes (pchr1[i], pchr2[i]),
+//joined by the region_split_character of the index.
+void key_exists2(char** pfn, char** pchr1, char** pchr2, int* pnkey, int* pflag){
+  int i;
+  pairix_t *tb = load(*pfn);
+  if(tb && tb->idx){
+    char region_split_character = ti_get_region_split_character(tb->idx);
+    kstring_t key = {0,0,0};
+    for(i=0;i<*pnkey;i++){
+      key.l = 0;
+      kputs(pchr1[i], &key);
+      kputc(region_split_character, &key);
+      kputs(pchr2[i], &key);
+      pflag[i] = ti_get_tid(tb->idx, key.s)!=-1?1:0;
+    }
+    free(key.s);
+  }
+  else pflag[0]= -1;
+  if(tb) ti_close(tb);
 }
 
 
@@ -134,260 +325,1836 @@ void Get_linecount(char** pfn, int* pflag){
 }
 
 
-//.Call-compatible
-//load + get size of the query result
-//input:
-//  _r_pfn : input filename (a single character string)
-//  _r_pquerystr : a character vector of query strings
-//  _r_pnquery : length _r_pquerystr (number of elements in the vector)
-//output is an R integer vector containing (n, max_len, flag).
-//  n : number of output lines
-//  max_len : maximum length of output lines
-//  flag : 0 if successfully run, -1 if there is an error (e.g. can't open input file)
-SEXP get_size(SEXP _r_pfn, SEXP _r_pquerystr, SEXP _r_pnquery){ 
+//pstatcols : 0-based columns for which per-block statistics are stored in the index (pnstatcols elements)
+// index parameters of file fn : a preset, custom columns (cols : sc, bc, ec, sc2, bc2, ec2) or the file extension.
+// return 0 if successful, -2 if the preset is not recognized, -5 if no preset is given and the file extension is not recognized.
+static int get_conf(const char *fn, const char *preset, const int *cols, char delimiter, char meta_char, char region_split_character, int line_skip, ti_conf_t *conf){
+  if (strcmp(preset, "") == 0 && cols[0] == 0 && cols[1] == 0){
+    int l = strlen(fn);
+    int strcasecmp(const char *s1, const char *s2);
+    if (l>=7 && strcasecmp(fn+l-7, ".gff.gz") == 0) *conf = ti_conf_gff;
+    else if (l>=7 && strcasecmp(fn+l-7, ".bed.gz") == 0) *conf = ti_conf_bed;
+    else if (l>=7 && strcasecmp(fn+l-7, ".sam.gz") == 0) *conf = ti_conf_sam;
+    else if (l>=7 && strcasecmp(fn+l-7, ".vcf.gz") == 0) *conf = ti_conf_vcf;
+    else if (l>=10 && strcasecmp(fn+l-10, ".psltbl.gz") == 0) *conf = ti_conf_psltbl;
+    else if (l>=9 && strcasecmp(fn+l-9, ".pairs.gz") == 0) *conf = ti_conf_pairs;
+    else return(-5); // file extension not recognized and no preset specified
+  }
+  else if (strcmp(preset, "") == 0 && cols[0] != 0 && cols[1] != 0){
+    conf->sc = cols[0];
+    conf->bc = cols[1];
+    conf->ec = cols[2];
+    conf->sc2 = cols[3];
+    conf->bc2 = cols[4];
+    conf->ec2 = cols[5];
+    conf->delimiter = delimiter;
+    conf->region_split_character = region_split_character;
+    conf->meta_char = (int)meta_char;
+    conf->line_skip = line_skip;
+  }
+  else if (strcmp(preset, "gff") == 0) *conf = ti_conf_gff;
+  else if (strcmp(preset, "bed") == 0) *conf = ti_conf_bed;
+  else if (strcmp(preset, "sam") == 0) *conf = ti_conf_sam;
+  else if (strcmp(preset, "vcf") == 0 || strcmp(preset, "vcf4") == 0) *conf = ti_conf_vcf;
+  else if (strcmp(preset, "psltbl") == 0) *conf = ti_conf_psltbl;
+  else if (strcmp(preset, "pairs") == 0) *conf = ti_conf_pairs;
+  else if (strcmp(preset, "merged_nodups") == 0) *conf = ti_conf_merged_nodups;
+  else if (strcmp(preset, "old_merged_nodups") == 0) *conf = ti_conf_old_merged_nodups;
+  else return(-2);  // wrong preset
 
-   // input conversion from R to C
-   // number of queries
-   PROTECT(_r_pnquery = AS_INTEGER(_r_pnquery));
-   int *pnquery = INTEGER_POINTER(_r_pnquery);
+  // region_split_character overrides preset
+  if (region_split_character != DEFAULT_REGION_SPLIT_CHARACTER) conf->region_split_character = region_split_character;
+  return(0);
+}
+
+void build_index(char **pinputfilename, char **ppreset, int *psc, int *pbc, int *pec, int *psc2, int *pbc2, int *pec2, char **pdelimiter, char **pmeta_char, char **pregion_split_character, int *pline_skip, int *pforce, int *pflag, int *pstatcols, int *pnstatcols, int *pthreads){
+
+  if(*pforce==0){
+    char *fnidx = calloc(strlen(*pinputfilename) + 5, 1);
+    strcat(strcpy(fnidx, *pinputfilename), ".px2");
+    struct stat stat_px2, stat_input;
+     if (stat(fnidx, &stat_px2) == 0){  // file exists.
+         // Before complaining, check if the input file isn't newer. This is a common source of errors,
+         // people tend not to notice that pairix failed
+         stat(*pinputfilename, &stat_input);
+         if ( stat_input.st_mtime <= stat_px2.st_mtime ) *pflag=-4;
+     }
+     free(fnidx);
+  }
+  if(*pflag != -4){
+    if ( bgzf_is_bgzf(*pinputfilename)!=1 ) *pflag = -3;
+    else {
+      ti_conf_t conf;
+      int cols[6] = { *psc, *pbc, *pec, *psc2, *pbc2, *pec2 };
+      *pflag = get_conf(*pinputfilename, *ppreset, cols, (*pdelimiter)[0], (*pmeta_char)[0], (*pregion_split_character)[0], *pline_skip, &conf);
+      if (*pflag == 0) *pflag= ti_index_build4(*pinputfilename, &conf, 0, pstatcols, *pnstatcols, *pthreads);  // -1 if failed
+    }
+  }
+}
+
+// update the index of a bgzipped file for the lines appended after its last indexed line. pnlines is the number of new lines.
+// flag : 0 if successful, -1 if the file or its index can't be opened, -2 if the index has no key statistics (built by an earlier version),
+//        -3 if the indexed data has changed, -4 if an end-of-file block is left before the new lines, -5 if the new lines can't be indexed
+//        (not sorted, or keys already in the index), -6 if the index file can't be written.
+void update_index(char **pinputfilename, int *pflag, double *pnlines){
+  uint64_t n = 0;
+  if ( bgzf_is_bgzf(*pinputfilename)!=1 ) { *pflag = -3; return; }
+  *pflag = ti_index_update(*pinputfilename, 0, &n);
+  *pnlines = (double)n;
+}
+
+// add a read name index on column pcol (0-based; -1 for the read name of the preset) to the index of a bgzipped file.
+// pn is the number of entries (distinct read name hashes per block).
+// flag : 0 if successful, -1 if the file or its index can't be opened, -2 if the index has no block offset table (built by an
+//        earlier version), -3 if the file can't be read, -4 if the index file can't be written.
+void index_reads(char **pinputfilename, int *pcol, int *pflag, double *pn){
+  int64_t n = ti_index_reads(*pinputfilename, 0, *pcol);
+  *pflag = n < 0 ? (int)n : 0;
+  *pn = n < 0 ? 0 : (double)n;
+}
+
+// compress a plain text or gzip file ("-" for the standard input) into a BGZF file. If pindex is 1, the output
+// file is indexed in the same pass, with the index parameters of build_index (the output file name is used for the extension).
+// flag : 0 if successful, -1 if the input file can't be opened, -2 if the output file can't be written,
+//        -3 if the input file can't be read, -4 if compression failed, -5 if the file can't be indexed (not sorted),
+//        -6 if the index file can't be written, -7 if the preset is not recognized, -8 if no preset is given and the extension is not recognized.
+void bgzip_file(char **pinputfilename, char **poutputfilename, int *plevel, int *pthreads, int *pflag, int *pindex, char **ppreset, int *pcols, char **pdelimiter, char **pmeta_char, char **pregion_split_character, int *pline_skip, int *pstatcols, int *pnstatcols){
+  ti_conf_t conf;
+  if(*pindex == 0) { *pflag = bgzf_compress_file(*pinputfilename, *poutputfilename, *plevel, *pthreads); return; }
+  *pflag = get_conf(*poutputfilename, *ppreset, pcols, (*pdelimiter)[0], (*pmeta_char)[0], (*pregion_split_character)[0], *pline_skip, &conf);
+  if(*pflag == -2) *pflag = -7;
+  else if(*pflag == -5) *pflag = -8;
+  else *pflag = ti_index_bgzip(*pinputfilename, *poutputfilename, &conf, 0, pstatcols, *pnstatcols, *plevel, *pthreads);
+}
+
+// convert a Juicer merged_nodups file (pold 1 for old_merged_nodups; plain text or gzip, "-" for the standard input) into a
+// bgzipped pairs file and index it in the same pass. pheader are header lines written before the '#columns' line.
+// flag : 0 if successful, -1 if the input file can't be opened, -2 if the output file can't be written, -3 if the input file
+//        can't be read, -4 if a line can't be parsed, -5 if the lines can't be indexed (chromosome pairs not grouped),
+//        -6 if the index can't be written.
+void convert_file(char **pinputfilename, char **poutputfilename, int *pold, char **pheader, int *pnheader, int *plevel, int *pstatcols, int *pnstatcols, int *pflag){
+  *pflag = ti_convert_merged_nodups(*pinputfilename, *poutputfilename, *pold, (const char**)pheader, *pnheader, pstatcols, *pnstatcols, *plevel);
+}
+
+// getting column names from header
+// works only for pairs
+SEXP get_column_names(SEXP _r_pfn){
 
    // file name
    char *pfn[1];
    PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
    pfn[0] = R_alloc(strlen(CHAR(STRING_ELT(_r_pfn, 0))), sizeof(char));
-   strcpy(pfn[0], CHAR(STRING_ELT(_r_pfn, 0))); 
-
-   // queries
-   char *pquerystr[*pnquery];
-   PROTECT(_r_pquerystr = AS_CHARACTER(_r_pquerystr));
-   int i;
-   for(i=0;i<*pnquery;i++){
-     pquerystr[i] = R_alloc(strlen(CHAR(STRING_ELT(_r_pquerystr, i))), sizeof(char)); 
-     strcpy(pquerystr[i], CHAR(STRING_ELT(_r_pquerystr, i))); 
-   }
+   strcpy(pfn[0], CHAR(STRING_ELT(_r_pfn, 0)));
+
+   pairix_t *tb = load(*pfn);
+   UNPROTECT(1);
+
+   if(tb){
+     const ti_conf_t *pconf = ti_get_conf(tb->idx);
+     if(pconf->preset!=TI_PRESET_PAIRS)
+        return(R_NilValue);
+ 
+     SEXP _r_presultstr;
+     PROTECT(_r_presultstr = allocVector(STRSXP, 1));
+ 
+     const char *s;
+     int len;
+     sequential_iter_t *siter = ti_query_general(tb, 0, 0, 0);
+     while ((s = sequential_ti_read(siter, &len)) != 0) {
+       if ((int)(*s) != pconf->meta_char) break;
+       if(strncmp(s,"#columns: ",10)==0) { SET_STRING_ELT(_r_presultstr, 0, mkChar(s)); break; }
+     }
+     destroy_sequential_iter(siter);
+     UNPROTECT(1);
+     return(_r_presultstr);
+   } else return(R_NilValue);
+     
+}
+
 
-   // to be return values
-   int n=0, max_len=0, flag=0;
 
-   int len=-1;
-   const char *s;
+
+//.Call-compatible
+//per-key (chromosome pair) statistics stored in the index
+//input:
+//  _r_pfn : input filename (a single character string)
+//output is an R list containing (stats, flag).
+//  stats : a named list of columns (key, chr1, chr2, count, min_pos1, max_pos1, min_pos2, max_pos2, compressed_bytes, uncompressed_bytes)
+//  flag : 0 if successfully run, -1 if the file can't be opened, -2 if the index has no key statistics (built by an older version)
+SEXP get_keystats(SEXP _r_pfn){
+
+   // file name
+   char *pfn[1];
+   PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
+   pfn[0] = R_alloc(strlen(CHAR(STRING_ELT(_r_pfn, 0)))+1, sizeof(char));
+   strcpy(pfn[0], CHAR(STRING_ELT(_r_pfn, 0)));
+
+   const char *colnames[] = { "key", "chr1", "chr2", "count", "min_pos1", "max_pos1", "min_pos2", "max_pos2", "compressed_bytes", "uncompressed_bytes" };
+   int ncols = 10;
+   int flag=0, n=0, i;
+   const ti_keystat_t *ks = NULL;
+   const char **keys = NULL;
 
    pairix_t *tb = load(*pfn);
+   if(tb && tb->idx){
+     keys = ti_seqname(tb->idx, &n);
+     if((ks = ti_get_keystats(tb->idx)) == NULL) { flag = -2; n = 0; }
+   }
+   else flag = -1; // error
 
-   if(tb){
-     int i;
-     for(i=0;i<*pnquery;i++){
-       sequential_iter_t *siter = ti_querys_2d_general(tb, pquerystr[i]);
-       while ((s = sequential_ti_read(siter, &len)) != 0) {
-         if(len>max_len) max_len = len;
-         n++;
+   SEXP _r_pstats;
+   PROTECT(_r_pstats = allocVector(VECSXP, ncols));
+   SEXP _r_pkey, _r_pchr1, _r_pchr2;
+   PROTECT(_r_pkey = NEW_CHARACTER(n));
+   PROTECT(_r_pchr1 = NEW_CHARACTER(n));
+   PROTECT(_r_pchr2 = NEW_CHARACTER(n));
+   SEXP _r_pcount, _r_pcbytes, _r_pubytes;
+   PROTECT(_r_pcount = NEW_NUMERIC(n));
+   PROTECT(_r_pcbytes = NEW_NUMERIC(n));
+   PROTECT(_r_pubytes = NEW_NUMERIC(n));
+   SEXP _r_pminpos1, _r_pmaxpos1, _r_pminpos2, _r_pmaxpos2;
+   PROTECT(_r_pminpos1 = NEW_INTEGER(n));
+   PROTECT(_r_pmaxpos1 = NEW_INTEGER(n));
+   PROTECT(_r_pminpos2 = NEW_INTEGER(n));
+   PROTECT(_r_pmaxpos2 = NEW_INTEGER(n));
+
+   if(flag == 0){
+     char region_split_character = ti_get_region_split_character(tb->idx);
+     for(i=0;i<n;i++){
+       const char *split = strchr(keys[i], region_split_character);
+       SET_STRING_ELT(_r_pkey, i, mkChar(keys[i]));
+       if(split){
+         SET_STRING_ELT(_r_pchr1, i, mkCharLen(keys[i], split - keys[i]));
+         SET_STRING_ELT(_r_pchr2, i, mkChar(split + 1));
+       } else {
+         SET_STRING_ELT(_r_pchr1, i, mkChar(keys[i]));
+         SET_STRING_ELT(_r_pchr2, i, NA_STRING);
        }
-       destroy_sequential_iter(siter);
+       REAL(_r_pcount)[i] = (double)ks[i].n;
+       INTEGER(_r_pminpos1)[i] = ks[i].beg + 1;  // 1-based
+       INTEGER(_r_pmaxpos1)[i] = ks[i].end;
+       INTEGER(_r_pminpos2)[i] = ks[i].end2 < 0 ? NA_INTEGER : ks[i].beg2 + 1;
+       INTEGER(_r_pmaxpos2)[i] = ks[i].end2 < 0 ? NA_INTEGER : ks[i].end2;
+       REAL(_r_pcbytes)[i] = (double)((ks[i].off_end >> 16) - (ks[i].off_beg >> 16));
+       REAL(_r_pubytes)[i] = (double)ks[i].ulen;
      }
+   }
+   if(keys) free(keys);
+   if(tb) ti_close(tb);
+
+   SET_VECTOR_ELT(_r_pstats, 0, _r_pkey);
+   SET_VECTOR_ELT(_r_pstats, 1, _r_pchr1);
+   SET_VECTOR_ELT(_r_pstats, 2, _r_pchr2);
+   SET_VECTOR_ELT(_r_pstats, 3, _r_pcount);
+   SET_VECTOR_ELT(_r_pstats, 4, _r_pminpos1);
+   SET_VECTOR_ELT(_r_pstats, 5, _r_pmaxpos1);
+   SET_VECTOR_ELT(_r_pstats, 6, _r_pminpos2);
+   SET_VECTOR_ELT(_r_pstats, 7, _r_pmaxpos2);
+   SET_VECTOR_ELT(_r_pstats, 8, _r_pcbytes);
+   SET_VECTOR_ELT(_r_pstats, 9, _r_pubytes);
+
+   SEXP _r_pnames;
+   PROTECT(_r_pnames = NEW_CHARACTER(ncols));
+   for(i=0;i<ncols;i++) SET_STRING_ELT(_r_pnames, i, mkChar(colnames[i]));
+   setAttrib(_r_pstats, R_NamesSymbol, _r_pnames);
+
+   // output
+   SEXP _r_preturn;
+   PROTECT(_r_preturn = allocVector(VECSXP, 2));
+   SET_VECTOR_ELT(_r_preturn, 0, _r_pstats);
+   SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(flag));
+
+   UNPROTECT(14);
+   return(_r_preturn);
+}
+
+
+//.Call-compatible
+//split a file into line-aligned ranges of about the same uncompressed size, from the block offset table of the index
+//input:
+//  _r_pfn : input filename (a single character string)
+//  _r_pn : number of ranges
+//output is an R list containing (ranges, flag).
+//  ranges : a named list of columns (start, end, ustart, uend, first_line, lines); start and end are virtual file offsets (hex strings),
+//           ustart and uend uncompressed byte offsets (end excluded) and first_line a 1-based line number
+//  flag : 0 if successfully run, -1 if the file can't be opened, -2 if the index has no block offset table (built by an older version)
+SEXP get_partition(SEXP _r_pfn, SEXP _r_pn){
+
+   // file name
+   char *pfn[1];
+   PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
+   pfn[0] = R_alloc(strlen(CHAR(STRING_ELT(_r_pfn, 0)))+1, sizeof(char));
+   strcpy(pfn[0], CHAR(STRING_ELT(_r_pfn, 0)));
 
-     ti_close(tb);
+   const char *colnames[] = { "start", "end", "ustart", "uend", "first_line", "lines" };
+   int ncols = 6;
+   int flag=0, n=0, i, nparts = asInteger(_r_pn);
+   const ti_blocktable_t *bt = NULL;
+   int64_t *part = NULL;
+
+   pairix_t *tb = load(*pfn);
+   if(tb && tb->idx){
+     if(nparts < 1) nparts = 1;
+     part = (int64_t*)malloc((nparts + 1) * sizeof(int64_t));
+     if((n = ti_partition(tb->idx, nparts, part)) < 0) { flag = -2; n = 0; }
+     bt = ti_get_blocktable(tb->idx);
    }
    else flag = -1; // error
-   
-   // output 
-   // preturn = (n, max_len, flag)
+
+   SEXP _r_pranges, _r_pstart, _r_pend, _r_pustart, _r_puend, _r_pfirst, _r_plines;
+   PROTECT(_r_pranges = allocVector(VECSXP, ncols));
+   PROTECT(_r_pstart = NEW_CHARACTER(n));
+   PROTECT(_r_pend = NEW_CHARACTER(n));
+   PROTECT(_r_pustart = NEW_NUMERIC(n));
+   PROTECT(_r_puend = NEW_NUMERIC(n));
+   PROTECT(_r_pfirst = NEW_NUMERIC(n));
+   PROTECT(_r_plines = NEW_NUMERIC(n));
+   for(i=0;i<n;i++){
+     char s[32];
+     int64_t b = part[i], e = part[i+1];
+     uint64_t uend = e < bt->n ? bt->uoff[e] : bt->ulen;
+     uint64_t lend = e < bt->n ? bt->line[e] : get_linecount(tb->idx);
+     sprintf(s, "%llx", (unsigned long long)bt->voff[b]);
+     SET_STRING_ELT(_r_pstart, i, mkChar(s));
+     sprintf(s, "%llx", (unsigned long long)(e < bt->n ? bt->voff[e] : bt->voff_end));
+     SET_STRING_ELT(_r_pend, i, mkChar(s));
+     REAL(_r_pustart)[i] = (double)bt->uoff[b];
+     REAL(_r_puend)[i] = (double)uend;
+     REAL(_r_pfirst)[i] = (double)bt->line[b] + 1;
+     REAL(_r_plines)[i] = (double)(lend - bt->line[b]);
+   }
+   free(part);
+   if(tb) ti_close(tb);
+
+   SET_VECTOR_ELT(_r_pranges, 0, _r_pstart);
+   SET_VECTOR_ELT(_r_pranges, 1, _r_pend);
+   SET_VECTOR_ELT(_r_pranges, 2, _r_pustart);
+   SET_VECTOR_ELT(_r_pranges, 3, _r_puend);
+   SET_VECTOR_ELT(_r_pranges, 4, _r_pfirst);
+   SET_VECTOR_ELT(_r_pranges, 5, _r_plines);
+
+   SEXP _r_pnames;
+   PROTECT(_r_pnames = NEW_CHARACTER(ncols));
+   for(i=0;i<ncols;i++) SET_STRING_ELT(_r_pnames, i, mkChar(colnames[i]));
+   setAttrib(_r_pranges, R_NamesSymbol, _r_pnames);
+
+   // output
    SEXP _r_preturn;
-   PROTECT(_r_preturn = NEW_INTEGER(3));
-   int *preturn = INTEGER_POINTER(_r_preturn);
-   preturn[0] = n;
-   preturn[1] = max_len;
-   preturn[2] = flag;
+   PROTECT(_r_preturn = allocVector(VECSXP, 2));
+   SET_VECTOR_ELT(_r_preturn, 0, _r_pranges);
+   SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(flag));
 
-   UNPROTECT(4);
+   UNPROTECT(10);
    return(_r_preturn);
 }
 
+static int rows_add_line(int l, const char *s, void *data){
+  linebuf_add((linebuf_t*)data, s, l);
+  return(0);
+}
 
 //.Call-compatible
-//load + return the result
+//read data lines by number, using the block offset table of the index.
 //input:
 //  _r_pfn : input filename (a single character string)
-//  _r_pquerystr : a character vector of query strings
-//  _r_pnquery : length _r_pquerystr (number of elements in the vector)
-//  _r_pn : length of the result strings (number of lines)
-//output is an R list containing (resultstr, flag).
-//  resultstr : a character vector of result strings
-//  flag : 0 if successfully run, -1 if there is an error (e.g. can't open input file)
-SEXP get_lines(SEXP _r_pfn, SEXP _r_pquerystr, SEXP _r_pnquery, SEXP _r_pn){ 
-
-   // input conversion from R to C
-   // number of queries
-   PROTECT(_r_pnquery = AS_INTEGER(_r_pnquery));
-   int *pnquery = INTEGER_POINTER(_r_pnquery);
+//  _r_prows : 1-based numbers of the data lines (header lines excluded), in increasing order (numeric); rows past the end are ignored
+//output is an R list containing (result, flag, nrows).
+//  result : a list of character columns, with the lines in file order
+//  flag : 0 if successfully run, -1 if the file can't be opened, -2 if the index has no block offset table (built by an older version), -3 on a read error
+//  nrows : number of data lines in the file
+SEXP read_rows(SEXP _r_pfn, SEXP _r_prows){
 
    // file name
    char *pfn[1];
    PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
-   pfn[0] = R_alloc(strlen(CHAR(STRING_ELT(_r_pfn, 0))), sizeof(char));
-   strcpy(pfn[0], CHAR(STRING_ELT(_r_pfn, 0))); 
-
-   // queries
-   char *pquerystr[*pnquery];
-   PROTECT(_r_pquerystr = AS_CHARACTER(_r_pquerystr));
-   int i;
-   for(i=0;i<*pnquery;i++){
-     pquerystr[i] = R_alloc(strlen(CHAR(STRING_ELT(_r_pquerystr, i))), sizeof(char)); 
-     strcpy(pquerystr[i], CHAR(STRING_ELT(_r_pquerystr, i))); 
+   pfn[0] = R_alloc(strlen(CHAR(STRING_ELT(_r_pfn, 0)))+1, sizeof(char));
+   strcpy(pfn[0], CHAR(STRING_ELT(_r_pfn, 0)));
+   PROTECT(_r_prows = AS_NUMERIC(_r_prows));
+
+   int flag=0, i, n = length(_r_prows);
+   double nrows = 0;
+   linebuf_t lb;
+   memset(&lb, 0, sizeof(linebuf_t));
+
+   pairix_t *tb = load(*pfn);
+   if(tb && tb->idx){
+     const ti_keystat_t *ks = ti_get_keystats(tb->idx);
+     const char **keys;
+     uint64_t first = (uint64_t)-1;
+     int64_t header;
+     int nkeys;
+     // the header lines are the lines before the first record
+     keys = ti_seqname(tb->idx, &nkeys);
+     free(keys);
+     for(i=0;ks && i<nkeys;i++) if(ks[i].n > 0 && ks[i].off_beg < first) first = ks[i].off_beg;
+     if((header = ti_get_line_number(tb->fp, tb->idx, first)) < 0) flag = -2;
+     else {
+       uint64_t *rows = (uint64_t*)R_alloc(n > 0 ? n : 1, sizeof(uint64_t));
+       int m = 0;
+       nrows = (double)(get_linecount(tb->idx) - header);
+       for(i=0;i<n;i++) if(REAL(_r_prows)[i] >= 1 && REAL(_r_prows)[i] <= nrows) rows[m++] = (uint64_t)REAL(_r_prows)[i] - 1 + header;
+       if(ti_read_rows(tb->fp, tb->idx, rows, m, &lb, rows_add_line) < 0) flag = -3;
+     }
    }
+   else flag = -1; // error
+
+   SEXP _r_preturn;
+   PROTECT(_r_preturn = allocVector(VECSXP, 3));
+   if(flag == 0) SET_VECTOR_ELT(_r_preturn, 0, linebuf_to_columns(&lb, ti_get_delimiter(tb->idx), NULL, 0));
+   SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(flag));
+   SET_VECTOR_ELT(_r_preturn, 2, ScalarReal(nrows));
+   linebuf_destroy(&lb);
+   if(tb) ti_close(tb);
+
+   UNPROTECT(3);
+   return(_r_preturn);
+}
 
-   // number of lines in the query result
-   PROTECT(_r_pn = AS_INTEGER(_r_pn));
-   int *pn = INTEGER_POINTER(_r_pn);
+//.Call-compatible
+//read the lines with the given read names, using the read name index of the index file (see index_reads).
+//input:
+//  _r_pfn : input filename (a single character string)
+//  _r_pids : read names (character)
+//output is an R list containing (result, flag, n).
+//  result : a list of character columns, with the lines in file order
+//  flag : 0 if successfully run, -1 if the file can't be opened, -2 if the index has no read name index, -3 on a read error
+//  n : number of lines found
+SEXP lookup_reads(SEXP _r_pfn, SEXP _r_pids){
+
+   // file name
+   char *pfn[1];
+   PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
+   pfn[0] = R_alloc(strlen(CHAR(STRING_ELT(_r_pfn, 0)))+1, sizeof(char));
+   strcpy(pfn[0], CHAR(STRING_ELT(_r_pfn, 0)));
+   PROTECT(_r_pids = AS_CHARACTER(_r_pids));
 
-   // to be return values
-   SEXP _r_presultstr;
-   PROTECT(_r_presultstr = allocVector(VECSXP, *pn));
-   int flag=0;
+   int flag=0, i, n = 0;
+   int64_t nfound = 0;
+   linebuf_t lb;
+   memset(&lb, 0, sizeof(linebuf_t));
+   const char **ids = (const char**)R_alloc(length(_r_pids) > 0 ? length(_r_pids) : 1, sizeof(char*));
+   for(i=0;i<length(_r_pids);i++) if(STRING_ELT(_r_pids, i) != NA_STRING) ids[n++] = CHAR(STRING_ELT(_r_pids, i));
 
    pairix_t *tb = load(*pfn);
+   if(tb && tb->idx){
+     nfound = ti_lookup_reads(tb->fp, tb->idx, ids, n, &lb, rows_add_line);
+     if(nfound < 0) flag = nfound == -1 ? -2 : -3;
+   }
+   else flag = -1; // error
 
-   int ncols=0; 
-   SEXP _r_presultstr_line[*pn];
-   if(tb){
-     const ti_conf_t *pconf = ti_get_conf(tb->idx);
-     int i, ires=0, k=0;  // i is index for querystr, ires is index for result line
-     for(i=0;i<*pnquery;i++){
-       sequential_iter_t *siter = ti_querys_2d_general(tb, pquerystr[i]);
-       char *s;
-       int len=-1;
-       while ((s = sequential_ti_read(siter, &len)) != 0) {
-         int j,start=0,m=0; // j is position on result line, start is start position of the current column, m is the index of the current column
-         if(ncols==0) for(j=0;j<=len;j++) if(s[j]==pconf->delimiter||s[j]==0) ncols++;
-         PROTECT(_r_presultstr_line[ires] = allocVector(STRSXP, ncols));
-         for(j=0;j<=len;j++){
-            if(s[j]==pconf->delimiter || s[j]==0) { 
-              s[j]=0;
-              SET_STRING_ELT(_r_presultstr_line[ires], m++, mkChar(s+start));
-              s[j]=pconf->delimiter; start=j+1;
-            }
-         }
-         SET_VECTOR_ELT(_r_presultstr, k++, _r_presultstr_line[ires]); 
-         ires++;
+   SEXP _r_preturn;
+   PROTECT(_r_preturn = allocVector(VECSXP, 3));
+   if(flag == 0) SET_VECTOR_ELT(_r_preturn, 0, linebuf_to_columns(&lb, ti_get_delimiter(tb->idx), NULL, 0));
+   SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(flag));
+   SET_VECTOR_ELT(_r_preturn, 2, ScalarReal(flag == 0 ? (double)nfound : 0));
+   linebuf_destroy(&lb);
+   if(tb) ti_close(tb);
+
+   UNPROTECT(3);
+   return(_r_preturn);
+}
+
+
+// a query region resolved against the index (0-based, half-open positions)
+typedef struct {
+  int tid, beg, end, beg2, end2;
+} px_region_t;
+
+typedef struct {
+  px_region_t *a;
+  int n, m;
+} regionlist_t;
+
+static void regionlist_add(regionlist_t *rl, int tid, int beg, int end, int beg2, int end2){
+  if(rl->n == rl->m){
+    rl->m = rl->m ? rl->m<<1 : 16;
+    rl->a = realloc(rl->a, rl->m * sizeof(px_region_t));
+  }
+  px_region_t *r = rl->a + rl->n++;
+  r->tid = tid; r->beg = beg; r->end = end; r->beg2 = beg2; r->end2 = end2;
+}
+
+// resolve a region string and add it to the list. A wildcard mate ('*|chr2:s-e' or 'chr1:s-e|*') expands to
+// every chromosome pair in the index that matches the other mate. On a 2D index, a 1D region 'chr:s-e' with a band
+// width (>= 0) is the band 'chr:s-e|chr:(s-band)-(e+band)'; the row filter then keeps |pos2 - pos1| <= band.
+// Regions that do not exist in the file are not added.
+static void add_region_str(const ti_index_t *idx, const char *reg, regionlist_t *rl, double band){
+  const int *tids;
+  int tid, beg, end, beg2, end2, n, wild, i;
+  char region_split_character = ti_get_region_split_character((ti_index_t*)idx);
+  if(band >= 0 && ti_get_sc2((ti_index_t*)idx) >= 0 && !strchr(reg, region_split_character)){
+    const char *colon = strchr(reg, ':');
+    int len = colon ? colon - reg : strlen(reg);
+    kstring_t key = {0,0,0};
+    beg = 0; end = ti_get_max_pos();
+    if(colon && ti_parse_pos(colon+1, &beg, &end) < 0) return;
+    kputsn(reg, len, &key); kputc(region_split_character, &key); kputsn(reg, len, &key);
+    tid = ti_get_tid(idx, key.s);
+    free(key.s);
+    if(tid < 0) return;
+    beg2 = beg - band < 0 ? 0 : (int)(beg - band);
+    end2 = end + band > ti_get_max_pos() ? ti_get_max_pos() : (int)(end + band);
+    regionlist_add(rl, tid, beg, end, beg2, end2);
+    return;
+  }
+  int res = ti_parse_region_wildcard(idx, reg, &tids, &n, &wild, &beg, &end);
+  if(res > 0){
+    for(i=0;i<n;i++){
+      if(wild == 1) regionlist_add(rl, tids[i], 0, ti_get_max_pos(), beg, end);
+      else regionlist_add(rl, tids[i], beg, end, 0, ti_get_max_pos());
+    }
+  }
+  else if(res == 0 && ti_parse_region2d(idx, reg, &tid, &beg, &end, &beg2, &end2) == 0) regionlist_add(rl, tid, beg, end, beg2, end2);
+}
+
+// tid of the chromosome pair (levels1[c1], levels2[c2]), or of (levels2[c2], levels1[c1]) if flip is set.
+// lookups are cached in h, so each unique pair is resolved once.
+static int pair_tid(const ti_index_t *idx, khash_t(id) *h, SEXP _r_plevels1, int c1, SEXP _r_plevels2, int c2, int flip, kstring_t *key){
+  int ret;
+  khint_t k = kh_put(id, h, (uint64_t)c1<<32 | (uint32_t)c2 | (flip ? 1ULL<<63 : 0), &ret);
+  if(ret){
+    key->l = 0;
+    kputs(CHAR(flip ? STRING_ELT(_r_plevels2, c2) : STRING_ELT(_r_plevels1, c1)), key);
+    kputc(ti_get_region_split_character((ti_index_t*)idx), key);
+    kputs(CHAR(flip ? STRING_ELT(_r_plevels1, c1) : STRING_ELT(_r_plevels2, c2)), key);
+    kh_value(h, k) = ti_get_tid(idx, key->s);
+  }
+  return(kh_value(h, k));
+}
+
+static int region_overlaps(const px_region_t *r, const ti_intv_t *intv){
+  return(r->tid == intv->tid && intv->end > r->beg && r->end > intv->beg
+         && (r->beg2==-1 || r->end2==-1 || (intv->end2 > r->beg2 && r->end2 > intv->beg2)));
+}
+
+// column permutation that swaps mate1 and mate2 columns (chromosome, positions and, for known presets, strand etc.)
+// returns the number of columns involved.
+static int mate_swap_perm(ti_index_t *idx, int *perm){
+  int pairs[MAX_SWAP_COLS][2], np=0, i, nperm=0;
+  pairs[np][0] = ti_get_sc(idx); pairs[np++][1] = ti_get_sc2(idx);
+  pairs[np][0] = ti_get_bc(idx); pairs[np++][1] = ti_get_bc2(idx);
+  if(ti_get_ec(idx) != ti_get_bc(idx) && ti_get_ec2(idx) != ti_get_bc2(idx)) { pairs[np][0] = ti_get_ec(idx); pairs[np++][1] = ti_get_ec2(idx); }
+  switch(ti_get_conf(idx)->preset&0xffff){
+    case TI_PRESET_PAIRS:  // strand1 strand2
+      pairs[np][0] = 5; pairs[np++][1] = 6;
+      break;
+    case TI_PRESET_MERGED_NODUPS:  // str, frag, mapq, cigar, sequence, readname
+      pairs[np][0] = 0; pairs[np++][1] = 4;
+      pairs[np][0] = 3; pairs[np++][1] = 7;
+      for(i=0;i<3;i++) { pairs[np][0] = 8+i; pairs[np++][1] = 11+i; }
+      pairs[np][0] = 14; pairs[np++][1] = 15;
+      break;
+    case TI_PRESET_OLD_MERGED_NODUPS:  // str, frag
+      pairs[np][0] = 1; pairs[np++][1] = 5;
+      pairs[np][0] = 4; pairs[np++][1] = 8;
+      break;
+  }
+  for(i=0;i<MAX_SWAP_COLS;i++) perm[i] = i;
+  for(i=0;i<np;i++){
+    int a = pairs[i][0], b = pairs[i][1];
+    if(a < 0 || b < 0 || a == b || a >= MAX_SWAP_COLS || b >= MAX_SWAP_COLS) continue;
+    perm[a] = b; perm[b] = a;
+    if(a >= nperm) nperm = a+1;
+    if(b >= nperm) nperm = b+1;
+  }
+  return(nperm);
+}
+
+#define FILTER_IN  0  // the field is one of the values
+#define FILTER_MIN 1  // the field is a number >= x
+#define FILTER_MAX 2  // the field is a number <= x
+
+// a predicate on one column of a line
+typedef struct {
+  int col, op;
+  double x;
+  int nvalues;
+  const char **values;
+  int *lvalues;
+} px_filter_t;
+
+// row filters evaluated on each line before it is collected
+typedef struct {
+  int n, maxcol;
+  px_filter_t *a;
+  int distance;                       // a distance filter is set
+  double min_distance, max_distance;  // on |pos2 - pos1|, intra-chromosomal pairs only
+  char *cis;                          // per tid, 1 if both mates are on the same chromosome
+  int sample, sample_col;             // lines are sampled on the hash of a column (0-based, in stored orientation)
+  uint64_t sample_seed, sample_max;   // seed of the hash, and the bound under which the (53-bit) hash is kept
+  int on;                             // any of the above is set
+  int *fb, *fe;                       // field boundaries of the current line
+} rowfilter_t;
+
+// a set of queries on a file and the position reached while reading them.
+typedef struct {
+  pairix_t *tb;
+  linebuf_t lb;
+  double n, total_len, max_mem;
+  int linecount_only, flag;
+  int batch;               // lines are read in batches : reaching max_mem ends the batch instead of failing
+  int *sel, nsel;          // 0-based columns to return (all columns if nsel is 0)
+  int perm[MAX_SWAP_COLS], nperm;
+  rowfilter_t filter;
+  uint8_t *skip[2];        // blocks that can be skipped given the filters, in stored and swapped orientation (NULL if none)
+  int nquery, autoflip, symmetric;
+  regionlist_t *fwd, *flp; // regions of each query, in stored and flipped orientation
+  int qi, phase, ri;       // current query, orientation (0 : fwd, 1 : flp) and region
+  double found;            // lines found by the fwd regions of the current query
+  ti_iter_t iter;          // iterator over the current region (NULL if not open)
+  int preview;             // if > 0, only this number of blocks is read in each region, evenly spread over it
+  double nblocks, nblocks_total;  // blocks read and blocks covered by the regions opened
+} query_t;
+
+// open the iterator over a region, in stored (swap = 0) or swapped orientation.
+static void query_open_iter(query_t *q, const px_region_t *r, int swap){
+  int64_t ntotal;
+  q->iter = ti_iter_query(q->tb->idx, r->tid, r->beg, r->end, r->beg2, r->end2);
+  ti_iter_set_skip(q->iter, q->skip[swap]);
+  if(q->preview > 0){
+    q->nblocks += ti_iter_sample_blocks(q->iter, q->preview, &ntotal);
+    q->nblocks_total += ntotal;
+  }
+}
+
+// hash of a field for sampling : FNV-1a from a seeded basis, then the murmur3 finalizer so that all bits are mixed.
+// It only depends on the field and the seed, so a read is kept or dropped the same way in every query and every file.
+static uint64_t sample_hash(const char *s, int len, uint64_t seed){
+  uint64_t h = 0xcbf29ce484222325ULL ^ seed * 0x9e3779b97f4a7c15ULL;
+  int i;
+  for(i=0;i<len;i++) { h ^= (uint8_t)s[i]; h *= 0x100000001b3ULL; }
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return(h);
+}
+
+// 1 if the line passes all row filters. If swap is set, the line is evaluated in the swapped (query) orientation.
+// The sampling column is taken in stored orientation.
+static int row_passes(query_t *q, const char *s, int len, const ti_intv_t *intv, int swap){
+  rowfilter_t *f = &q->filter;
+  int i, j, k=0, m, p=0;
+  if(f->distance){
+    if(!f->cis[intv->tid]) return(0);
+    double d = intv->beg2 > intv->beg ? intv->beg2 - intv->beg : intv->beg - intv->beg2;
+    if(d < f->min_distance || d > f->max_distance) return(0);
+  }
+  if(f->n == 0 && !f->sample) return(1);
+  char delimiter = ti_get_delimiter(q->tb->idx);
+  for(m=0;m<=len && k<=f->maxcol;m++)
+    if(m==len || s[m]==delimiter) { f->fb[k] = p; f->fe[k++] = m; p = m+1; }
+  if(f->sample){
+    if(f->sample_col >= k) return(0);
+    if(sample_hash(s + f->fb[f->sample_col], f->fe[f->sample_col] - f->fb[f->sample_col], f->sample_seed) >> 11 >= f->sample_max) return(0);
+  }
+  for(i=0;i<f->n;i++){
+    const px_filter_t *pf = f->a + i;
+    int col = swap && pf->col < q->nperm ? q->perm[pf->col] : pf->col;
+    if(col >= k) return(0);
+    const char *field = s + f->fb[col];
+    int flen = f->fe[col] - f->fb[col];
+    if(pf->op == FILTER_IN){
+      for(j=0;j<pf->nvalues;j++) if(pf->lvalues[j]==flen && memcmp(pf->values[j], field, flen)==0) break;
+      if(j == pf->nvalues) return(0);
+    } else {
+      char *end;
+      double v;
+      if(flen == 0 || isspace((unsigned char)*field)) return(0);
+      v = strtod(field, &end);
+      if(end != field + flen) return(0);  // not a number (strtod must not run into the next column)
+      if(pf->op == FILTER_MIN ? v < pf->x : v > pf->x) return(0);
+    }
+  }
+  return(1);
+}
+
+// read the lines of the queries from the current position, up to limit lines. For each query, the fwd regions are read
+// first, then the flp regions (if symmetric, or if autoflip and the fwd regions returned no line). flp regions identical to
+// a fwd region and lines already returned by a fwd region are skipped; in symmetric mode, mate columns of the flp lines
+// are swapped. Returns the number of lines read.
+static double query_read(query_t *q, double limit){
+  double n0 = q->n;
+  int j, len;
+  const char *s;
+  char delimiter = ti_get_delimiter(q->tb->idx);
+  while(q->qi < q->nquery && q->flag==0 && q->n - n0 < limit){
+    const regionlist_t *rl = q->phase ? q->flp + q->qi : q->fwd + q->qi, *done = q->phase ? q->fwd + q->qi : 0;
+    int swap = q->phase && q->symmetric;
+    if(q->ri == rl->n || (q->phase && !q->symmetric && q->found > 0)){  // next orientation or next query
+      if(q->phase == 0 && (q->symmetric || q->autoflip)) q->phase = 1;
+      else { q->qi++; q->phase = 0; q->found = 0; }
+      q->ri = 0;
+      continue;
+    }
+    if(!q->iter){
+      const px_region_t *r = rl->a + q->ri;
+      if(done) {
+        for(j=0;j<done->n;j++) if(memcmp(r, done->a + j, sizeof(px_region_t))==0) break;
+        if(j<done->n) { q->ri++; continue; }
+      }
+      query_open_iter(q, r, swap);
+    }
+    while(q->n - n0 < limit){
+      if((s = ti_iter_read(q->tb->fp, q->iter, &len, 0)) == 0) {
+        ti_iter_destroy(q->iter); q->iter = 0; q->ri++;
+        break;
+      }
+      if(q->filter.on && !row_passes(q, s, len, ti_iter_get_intv(q->iter), swap)) continue;
+      if(done) {
+        const ti_intv_t *intv = ti_iter_get_intv(q->iter);
+        for(j=0;j<done->n;j++) if(region_overlaps(done->a + j, intv)) break;
+        if(j<done->n) continue;
+      }
+      q->n++;
+      if(!q->phase) q->found++;
+      if(q->linecount_only) continue;
+      q->total_len += len;
+      if(q->total_len > q->max_mem && !q->batch) { q->flag = -2; break; }
+      if(swap) linebuf_add_permuted(&q->lb, s, len, delimiter, q->perm, q->nperm);
+      else linebuf_add(&q->lb, s, len);
+      if(q->batch && q->total_len >= q->max_mem) limit = q->n - n0;  // the batch is full
+    }
+  }
+  return(q->n - n0);
+}
+
+// element of a named list, or R_NilValue
+static SEXP get_opt(SEXP _r_popts, const char *name){
+  SEXP _r_pnames = getAttrib(_r_popts, R_NamesSymbol);
+  int i;
+  for(i=0;i<length(_r_popts);i++)
+    if(strcmp(CHAR(STRING_ELT(_r_pnames, i)), name)==0) return(VECTOR_ELT(_r_popts, i));
+  return(R_NilValue);
+}
+
+
+// set up the row filters from the options (filter_cols, filter_ops, filter_values, min_distance, max_distance,
+// sample_fraction, sample_col, sample_seed). perm[0..nperm) is the column permutation of swapped lines (nperm is 0 if
+// lines are never swapped); the fields are split up to the last column a filter reads in either orientation.
+// values point to R strings, which must be kept alive (protected) as long as the filters are used.
+static void rowfilter_init(rowfilter_t *f, const ti_index_t *idx, SEXP _r_popts, const int *perm, int nperm){
+  SEXP _r_pcols = get_opt(_r_popts, "filter_cols"), _r_pops = get_opt(_r_popts, "filter_ops"), _r_pvalues = get_opt(_r_popts, "filter_values");
+  int i, j;
+  f->n = length(_r_pcols);
+  f->maxcol = -1;
+  if(f->n > 0){
+    f->a = (px_filter_t*)calloc(f->n, sizeof(px_filter_t));
+    for(i=0;i<f->n;i++){
+      px_filter_t *pf = f->a + i;
+      SEXP _r_pv = VECTOR_ELT(_r_pvalues, i);
+      pf->col = INTEGER(_r_pcols)[i];
+      pf->op = INTEGER(_r_pops)[i];
+      if(pf->col > f->maxcol) f->maxcol = pf->col;
+      if(pf->col < nperm && perm[pf->col] > f->maxcol) f->maxcol = perm[pf->col];  // the column read in swapped lines
+      if(pf->op == FILTER_IN){
+        pf->nvalues = length(_r_pv);
+        pf->values = (const char**)malloc((pf->nvalues ? pf->nvalues : 1) * sizeof(char*));
+        pf->lvalues = (int*)malloc((pf->nvalues ? pf->nvalues : 1) * sizeof(int));
+        for(j=0;j<pf->nvalues;j++) { pf->values[j] = CHAR(STRING_ELT(_r_pv, j)); pf->lvalues[j] = strlen(pf->values[j]); }
+      }
+      else pf->x = asReal(_r_pv);
+    }
+  }
+  double fraction = asReal(get_opt(_r_popts, "sample_fraction"));
+  if(!ISNA(fraction) && fraction < 1){
+    f->sample = 1;
+    f->sample_col = asInteger(get_opt(_r_popts, "sample_col"));
+    if(f->sample_col == NA_INTEGER || f->sample_col < 0)  // the read name : last column of merged_nodups, first otherwise
+      f->sample_col = (ti_get_conf((ti_index_t*)idx)->preset&0xffff) == TI_PRESET_MERGED_NODUPS ? 14 : 0;
+    double seed = asReal(get_opt(_r_popts, "sample_seed"));
+    // px_query_args bounds the seed; anything out of the int64 range (or NA) would make the cast undefined
+    f->sample_seed = !ISNAN(seed) && fabs(seed) < 9223372036854775808.0 ? (uint64_t)(int64_t)seed : 0;
+    f->sample_max = fraction > 0 ? (uint64_t)(fraction * 9007199254740992.0) : 0;  // 2^53
+    if(f->sample_col > f->maxcol) f->maxcol = f->sample_col;
+  }
+  if(f->n > 0 || f->sample){
+    f->fb = (int*)malloc((f->maxcol+1) * sizeof(int));
+    f->fe = (int*)malloc((f->maxcol+1) * sizeof(int));
+  }
+  f->min_distance = asReal(get_opt(_r_popts, "min_distance"));
+  f->max_distance = asReal(get_opt(_r_popts, "max_distance"));
+  f->distance = !ISNA(f->min_distance) || !ISNA(f->max_distance);
+  if(ISNA(f->min_distance)) f->min_distance = R_NegInf;
+  if(ISNA(f->max_distance)) f->max_distance = R_PosInf;
+  if(f->distance){
+    int n;
+    const char **keys = ti_seqname(idx, &n);
+    char region_split_character = ti_get_region_split_character((ti_index_t*)idx);
+    f->cis = malloc(n > 0 ? n : 1);
+    for(i=0;i<n;i++){
+      const char *sp = strchr(keys[i], region_split_character);
+      f->cis[i] = sp && strlen(sp+1) == (size_t)(sp - keys[i]) && strncmp(keys[i], sp+1, sp - keys[i]) == 0;
+    }
+    free(keys);
+  }
+  f->on = f->n > 0 || f->distance || f->sample;
+}
+
+static void rowfilter_destroy(rowfilter_t *f){
+  int i;
+  for(i=0;i<f->n;i++) { free(f->a[i].values); free(f->a[i].lvalues); }
+  free(f->a); free(f->fb); free(f->fe); free(f->cis);
+}
+
+// column of the block statistics for a 0-based column, or -1
+static int chunkstats_col(const ti_chunkstats_t *cs, int col){
+  int j;
+  for(j=0;j<cs->ncols;j++) if(cs->col[j] == col) return(j);
+  return(-1);
+}
+
+// flag the blocks in which, according to the block statistics, no record can pass the row filters.
+// A distance filter uses the position ranges of both mates (statistics on the bc and bc2 columns).
+// returns NULL if none of the filters is on a column with statistics.
+static uint8_t *rowfilter_skip(const rowfilter_t *f, ti_index_t *idx, const int *perm, int nperm, int swap){
+  const ti_chunkstats_t *cs = ti_get_chunkstats(idx);
+  uint8_t *skip = NULL;
+  int i, j, j2, k, v, b;
+  if(!cs) return(NULL);
+  for(i=0;i<f->n;i++){
+    const px_filter_t *pf = f->a + i;
+    int col = swap && pf->col < nperm ? perm[pf->col] : pf->col;
+    uint64_t mask = 0;
+    if((j = chunkstats_col(cs, col)) < 0) continue;
+    if(pf->op == FILTER_IN){
+      if(cs->ndict[j] < 0) continue;
+      for(v=0;v<pf->nvalues;v++)
+        for(k=0;k<cs->ndict[j];k++) if(strcmp(cs->dict[j][k], pf->values[v])==0) mask |= 1ULL<<k;
+    }
+    if(!skip) skip = (uint8_t*)calloc(cs->nblocks > 0 ? cs->nblocks : 1, 1);
+    for(b=0;b<cs->nblocks;b++){
+      int64_t x = (int64_t)b*cs->ncols + j;
+      if(pf->op == FILTER_IN ? (cs->bits[x] & mask) == 0 : pf->op == FILTER_MIN ? cs->max[x] < pf->x : cs->min[x] > pf->x) skip[b] = 1;
+    }
+  }
+  if(f->distance && (j = chunkstats_col(cs, ti_get_bc(idx))) >= 0 && (j2 = chunkstats_col(cs, ti_get_bc2(idx))) >= 0){
+    if(!skip) skip = (uint8_t*)calloc(cs->nblocks > 0 ? cs->nblocks : 1, 1);
+    for(b=0;b<cs->nblocks;b++){
+      const double *mn = cs->min + (int64_t)b*cs->ncols, *mx = cs->max + (int64_t)b*cs->ncols;
+      double dmin = mn[j2] > mx[j] ? mn[j2] - mx[j] : mn[j] > mx[j2] ? mn[j] - mx[j2] : 0;  // closest pos1/pos2 in the block
+      double dmax = mx[j2] - mn[j] > mx[j] - mn[j2] ? mx[j2] - mn[j] : mx[j] - mn[j2];
+      if(mn[j] > mx[j] || mn[j2] > mx[j2]) continue;  // no numeric positions
+      if(dmin > f->max_distance || dmax < f->min_distance) skip[b] = 1;
+    }
+  }
+  return(skip);
+}
+
+// open the file and set up the options of a query (see query_lines). Returns the flag (0, or -1 if the file can't be opened).
+static int query_init(query_t *q, const char *fn, SEXP _r_popts){
+  memset(q, 0, sizeof(query_t));
+  q->max_mem = asReal(get_opt(_r_popts, "max_mem"));
+  q->linecount_only = asLogical(get_opt(_r_popts, "linecount_only"))==TRUE;
+  q->autoflip = asLogical(get_opt(_r_popts, "autoflip"))==TRUE;
+  q->symmetric = asLogical(get_opt(_r_popts, "symmetric"))==TRUE;
+  q->preview = asInteger(get_opt(_r_popts, "preview"));
+  if(q->preview == NA_INTEGER) q->preview = 0;
+  SEXP _r_pcolumns;
+  PROTECT(_r_pcolumns = AS_INTEGER(get_opt(_r_popts, "columns")));
+  q->nsel = length(_r_pcolumns);
+  q->sel = malloc((q->nsel ? q->nsel : 1) * sizeof(int));
+  if(q->nsel) memcpy(q->sel, INTEGER(_r_pcolumns), q->nsel * sizeof(int));
+  UNPROTECT(1);
+  if(!(q->tb = load((char*)fn)) || !q->tb->idx) return(q->flag = -1);
+  ti_index_t *idx = q->tb->idx;
+  if(q->symmetric) q->nperm = mate_swap_perm(idx, q->perm);
+  rowfilter_init(&q->filter, idx, _r_popts, q->perm, q->nperm);
+  q->skip[0] = rowfilter_skip(&q->filter, idx, q->perm, q->nperm, 0);
+  if(q->symmetric) q->skip[1] = rowfilter_skip(&q->filter, idx, q->perm, q->nperm, 1);
+  return(0);
+}
+
+// resolve the queries (see query_lines) into the fwd and flp regions of each query.
+static void query_plan(query_t *q, SEXP _r_pquery){
+  ti_index_t *idx = q->tb->idx;
+  char region_split_character = ti_get_region_split_character(idx);
+  int max_pos = ti_get_max_pos();
+  double band = q->filter.distance && q->filter.max_distance < R_PosInf ? q->filter.max_distance : -1;
+  int typed = isNewList(_r_pquery), i, nprotect=0;
+  SEXP _r_pstart1=0, _r_pend1=0, _r_pstart2=0, _r_pend2=0, _r_plevels1=0, _r_plevels2=0;
+  int *codes1=0, *codes2=0;
+  if(typed){
+    q->nquery = length(VECTOR_ELT(_r_pquery, 0));
+    PROTECT(_r_pstart1 = AS_INTEGER(VECTOR_ELT(_r_pquery, 1)));
+    PROTECT(_r_pend1 = AS_INTEGER(VECTOR_ELT(_r_pquery, 2)));
+    PROTECT(_r_pstart2 = AS_INTEGER(VECTOR_ELT(_r_pquery, 4)));
+    PROTECT(_r_pend2 = AS_INTEGER(VECTOR_ELT(_r_pquery, 5)));
+    codes1 = (int*)R_alloc(q->nquery, sizeof(int));
+    codes2 = (int*)R_alloc(q->nquery, sizeof(int));
+    PROTECT(_r_plevels1 = chr_codes(VECTOR_ELT(_r_pquery, 0), codes1));
+    PROTECT(_r_plevels2 = chr_codes(VECTOR_ELT(_r_pquery, 3), codes2));
+    nprotect += 6;
+  } else {
+    PROTECT(_r_pquery = AS_CHARACTER(_r_pquery));
+    q->nquery = length(_r_pquery);
+    nprotect++;
+  }
+  q->fwd = (regionlist_t*)calloc(q->nquery ? q->nquery : 1, sizeof(regionlist_t));
+  q->flp = (regionlist_t*)calloc(q->nquery ? q->nquery : 1, sizeof(regionlist_t));
+  khash_t(id) *tids = kh_init(id);
+  kstring_t key = {0,0,0};
+  for(i=0;i<q->nquery;i++){
+    regionlist_t *fwd = q->fwd + i, *flp = q->flp + i;
+    if(typed){
+      if(codes1[i] < 0 || codes2[i] < 0) continue;
+      int *pstart1 = INTEGER(_r_pstart1), *pend1 = INTEGER(_r_pend1), *pstart2 = INTEGER(_r_pstart2), *pend2 = INTEGER(_r_pend2);
+      int beg = pstart1[i]==NA_INTEGER || pstart1[i]<1 ? 0 : pstart1[i]-1;
+      int end = pend1[i]==NA_INTEGER ? max_pos : pend1[i];
+      int beg2 = pstart2[i]==NA_INTEGER || pstart2[i]<1 ? 0 : pstart2[i]-1;
+      int end2 = pend2[i]==NA_INTEGER ? max_pos : pend2[i];
+      int tid = pair_tid(idx, tids, _r_plevels1, codes1[i], _r_plevels2, codes2[i], 0, &key);
+      if(tid >= 0) regionlist_add(fwd, tid, beg, end, beg2, end2);
+      if(q->autoflip || q->symmetric){
+        tid = pair_tid(idx, tids, _r_plevels1, codes1[i], _r_plevels2, codes2[i], 1, &key);
+        if(tid >= 0) regionlist_add(flp, tid, beg2, end2, beg, end);
+      }
+    } else {
+      if(STRING_ELT(_r_pquery, i) == NA_STRING) continue;
+      const char *reg = CHAR(STRING_ELT(_r_pquery, i));
+      add_region_str(idx, reg, fwd, band);
+      if((q->autoflip || q->symmetric) && strchr(reg, region_split_character))
+        add_region_str(idx, flip_region((char*)reg, region_split_character), flp, -1);
+    }
+  }
+  free(key.s);
+  kh_destroy(id, tids);
+  UNPROTECT(nprotect);
+}
+
+// fingerprint of the file, the resolved regions and the options that decide which lines are read (everything but the
+// columns returned and the memory limits), so that a resume token is only accepted by the query that made it.
+static uint64_t query_fingerprint(const query_t *q){
+  const rowfilter_t *f = &q->filter;
+  int opts[6] = { q->nquery, q->autoflip, q->symmetric, q->preview, f->n, f->sample ? f->sample_col : -1 };
+  double dopts[2] = { f->min_distance, f->max_distance };
+  uint64_t sopts[2] = { f->sample ? f->sample_seed : 0, f->sample ? f->sample_max : 0 };
+  uint64_t h = sample_hash(q->tb->fn, strlen(q->tb->fn), 0);
+  int i, j;
+  h = sample_hash((const char*)opts, sizeof(opts), h);
+  h = sample_hash((const char*)dopts, sizeof(dopts), h);
+  h = sample_hash((const char*)sopts, sizeof(sopts), h);
+  for(i=0;i<q->nquery;i++){
+    h = sample_hash((const char*)&q->fwd[i].n, sizeof(int), h);
+    h = sample_hash((const char*)q->fwd[i].a, q->fwd[i].n * sizeof(px_region_t), h);
+    h = sample_hash((const char*)&q->flp[i].n, sizeof(int), h);
+    h = sample_hash((const char*)q->flp[i].a, q->flp[i].n * sizeof(px_region_t), h);
+  }
+  for(i=0;i<f->n;i++){
+    const px_filter_t *pf = f->a + i;
+    int c[2] = { pf->col, pf->op };
+    h = sample_hash((const char*)c, sizeof(c), h);
+    if(pf->op != FILTER_IN) h = sample_hash((const char*)&pf->x, sizeof(double), h);
+    else for(j=0;j<pf->nvalues;j++) h = sample_hash(pf->values[j], pf->lvalues[j] + 1, h);  // with the NUL, as a separator
+  }
+  return(h);
+}
+
+// resume token : the position reached in the queries (query, orientation, region, lines found by the fwd regions of the
+// query and, if a region is being read, the chunk index and virtual offset of its iterator), the blocks read and covered
+// by the regions opened so far (preview), then the fingerprint of the query (see query_fingerprint). NA if all lines have been read.
+static SEXP query_token(query_t *q){
+  char buf[160];
+  int i = -1;
+  uint64_t off = 0;
+  if(q->qi >= q->nquery) return(ScalarString(NA_STRING));
+  if(q->iter) ti_iter_get_pos(q->iter, &i, &off);
+  snprintf(buf, sizeof(buf), "px2:%d:%d:%d:%.0f:%d:%d:%llx:%.0f:%.0f:%llx", q->qi, q->phase, q->ri, q->found, q->iter ? 1 : 0, i,
+           (unsigned long long)off, q->nblocks, q->nblocks_total, (unsigned long long)query_fingerprint(q));
+  return(mkString(buf));
+}
+
+// move to the position of a resume token made by query_token on the same queries. Returns 0, or -1 if the token is not valid
+// or was made by another query (file, regions or options).
+static int query_resume(query_t *q, const char *token){
+  int qi, phase, ri, open, i;
+  double found, nblocks, nblocks_total;
+  unsigned long long off, fp;
+  if(sscanf(token, "px2:%d:%d:%d:%lf:%d:%d:%llx:%lf:%lf:%llx", &qi, &phase, &ri, &found, &open, &i, &off, &nblocks, &nblocks_total, &fp) != 10) return(-1);
+  if(fp != (unsigned long long)query_fingerprint(q)) return(-1);
+  if(qi < 0 || qi > q->nquery || phase < 0 || phase > 1 || ri < 0 || found < 0 || nblocks < 0 || nblocks_total < nblocks) return(-1);
+  q->qi = qi; q->phase = phase; q->ri = ri; q->found = found;
+  if(qi < q->nquery && open){
+    const regionlist_t *rl = phase ? q->flp + qi : q->fwd + qi;
+    if(ri >= rl->n) return(-1);
+    query_open_iter(q, rl->a + ri, phase && q->symmetric);
+    if(ti_iter_set_pos(q->tb->fp, q->iter, i, off) < 0) return(-1);
+  }
+  q->nblocks = nblocks; q->nblocks_total = nblocks_total;  // the region being read is already counted
+  return(0);
+}
+
+// R list (result, flag, n, cursor, fraction) with the lines collected since the last call; the line buffer is emptied.
+static SEXP query_result(query_t *q, double n){
+  SEXP _r_preturn;
+  PROTECT(_r_preturn = allocVector(VECSXP, 5));
+  if(q->flag == 0 && !q->linecount_only)
+    SET_VECTOR_ELT(_r_preturn, 0, linebuf_to_columns(&q->lb, ti_get_delimiter(q->tb->idx), q->sel, q->nsel));
+  SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(q->flag));
+  SET_VECTOR_ELT(_r_preturn, 2, ScalarReal(n));
+  if(q->flag == 0) SET_VECTOR_ELT(_r_preturn, 3, query_token(q));
+  SET_VECTOR_ELT(_r_preturn, 4, ScalarReal(q->nblocks_total > 0 ? q->nblocks / q->nblocks_total : 1));
+  q->lb.n = 0; q->lb.buf.l = 0; q->total_len = 0;
+  UNPROTECT(1);
+  return(_r_preturn);
+}
+
+static void query_destroy(query_t *q){
+  int i;
+  for(i=0;i<q->nquery;i++) { free(q->fwd[i].a); free(q->flp[i].a); }
+  free(q->fwd); free(q->flp);
+  if(q->iter) ti_iter_destroy(q->iter);
+  rowfilter_destroy(&q->filter);
+  free(q->skip[0]); free(q->skip[1]); free(q->sel);
+  linebuf_destroy(&q->lb);
+  if(q->tb) ti_close(q->tb);
+  memset(q, 0, sizeof(query_t));
+}
+
+//.Call-compatible
+//load + return the result of a set of queries
+//input:
+//  _r_pfn : input filename (a single character string)
+//  _r_pquery : either a character vector of region strings, or a list of typed vectors (chr1, start1, end1, chr2, start2, end2).
+//              chr1 and chr2 are character or factor vectors; positions are 1-based, inclusive (NA means the whole chromosome).
+//  _r_popts : a named list of options
+//    max_mem : maximum total length of the result strings
+//    linecount_only : if TRUE, only count the lines
+//    autoflip : if TRUE, a query that returns no line is rerun with mate1 and mate2 flipped
+//    symmetric : if TRUE, each query returns the union of mate1|mate2 and mate2|mate1, with mate columns of the flipped
+//                lines swapped back into query orientation. Lines matching both orientations are returned once.
+//    columns : 0-based indices of the columns to return, in order (NULL for all columns)
+//    filter_cols, filter_ops, filter_values : row filters; column (0-based), operator (0: field is one of the values
+//                (character), 1: field >= value, 2: field <= value (numeric)) and values of each filter
+//    min_distance, max_distance : keep intra-chromosomal pairs with min_distance <= |pos2 - pos1| <= max_distance (NA for none)
+//                                 with max_distance, a 1D region on a 2D index is the band around the diagonal of that chromosome
+//    sample_fraction, sample_col, sample_seed : keep the lines whose hash of column sample_col (0-based, in stored orientation,
+//                -1 for the read name) with the seed is below sample_fraction of the hash range (NA for no sampling)
+//    limit : maximum number of lines to return (NA for no limit)
+//    cursor : resume token returned by a previous call with the same file, queries and options (NULL to start from the beginning)
+//    preview : if > 0, the number of compressed blocks read in each region, evenly spread over its chunks (NA to read all)
+//output is an R list containing (result, flag, n, cursor, fraction).
+//  result : a list of character columns (NULL if linecount_only)
+//  flag : 0 if successfully run, -1 if the file can't be opened, -2 if the result exceeds max_mem, -3 if the cursor is not valid
+//  n : number of output lines
+//  cursor : resume token for the lines after the last returned one (NA if all lines have been read)
+//  fraction : fraction of the blocks of the regions that were read (1 unless preview is set)
+SEXP query_lines(SEXP _r_pfn, SEXP _r_pquery, SEXP _r_popts){
+   query_t q;
+   SEXP _r_preturn, _r_pcursor = get_opt(_r_popts, "cursor");
+   double limit = asReal(get_opt(_r_popts, "limit"));
+   PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
+   if(query_init(&q, CHAR(STRING_ELT(_r_pfn, 0)), _r_popts) == 0){
+     query_plan(&q, _r_pquery);
+     if(isString(_r_pcursor) && length(_r_pcursor) == 1 && query_resume(&q, CHAR(STRING_ELT(_r_pcursor, 0))) < 0) q.flag = -3;
+     else query_read(&q, ISNA(limit) ? R_PosInf : limit);
+   }
+   PROTECT(_r_preturn = query_result(&q, q.n));
+   query_destroy(&q);
+   UNPROTECT(2);
+   return(_r_preturn);
+}
+
+static void query_cursor_finalize(SEXP _r_pcursor){
+  query_t *q = (query_t*)R_ExternalPtrAddr(_r_pcursor);
+  if(q) { query_destroy(q); free(q); R_ClearExternalPtr(_r_pcursor); }
+}
+
+//.Call-compatible
+//open a cursor over the lines of a set of queries, to be read in batches with read_query_cursor.
+//input: same as query_lines; linecount_only is ignored and max_mem bounds the total length of the lines of a batch.
+//output is an R list containing (cursor, flag).
+//  cursor : an external pointer to the open file and the position reached (NULL if flag is not 0)
+//  flag : 0 if successfully run, -1 if the file can't be opened
+SEXP open_query_cursor(SEXP _r_pfn, SEXP _r_pquery, SEXP _r_popts){
+   query_t *q = (query_t*)malloc(sizeof(query_t));
+   SEXP _r_pcursor = R_NilValue, _r_preturn;
+   PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
+   PROTECT(_r_preturn = allocVector(VECSXP, 2));
+   if(query_init(q, CHAR(STRING_ELT(_r_pfn, 0)), _r_popts) == 0){
+     q->linecount_only = 0;
+     q->batch = 1;
+     query_plan(q, _r_pquery);
+     // the options are kept with the cursor : the row filters point to their strings
+     PROTECT(_r_pcursor = R_MakeExternalPtr(q, R_NilValue, _r_popts));
+     R_RegisterCFinalizerEx(_r_pcursor, query_cursor_finalize, TRUE);
+     SET_VECTOR_ELT(_r_preturn, 0, _r_pcursor);
+     SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(0));
+     UNPROTECT(1);
+   } else {
+     SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(q->flag));
+     query_destroy(q); free(q);
+   }
+   UNPROTECT(2);
+   return(_r_preturn);
+}
+
+//.Call-compatible
+//read the next batch of lines from a cursor opened by open_query_cursor.
+//input:
+//  _r_pcursor : the cursor
+//  _r_pn : maximum number of lines in the batch (no line is read if it is below 1)
+//output is an R list containing (result, flag, n, cursor, fraction), as query_lines. n is 0 when all lines have been read;
+//the file is then closed and the following calls return no line.
+SEXP read_query_cursor(SEXP _r_pcursor, SEXP _r_pn){
+   query_t *q = (query_t*)R_ExternalPtrAddr(_r_pcursor);
+   SEXP _r_preturn;
+   if(!q){
+     PROTECT(_r_preturn = allocVector(VECSXP, 4));
+     SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(0));
+     SET_VECTOR_ELT(_r_preturn, 2, ScalarReal(0));
+     SET_VECTOR_ELT(_r_preturn, 3, ScalarString(NA_STRING));
+     UNPROTECT(1);
+     return(_r_preturn);
+   }
+   double nmax = asReal(_r_pn);
+   double n = nmax >= 1 ? query_read(q, nmax) : 0;
+   PROTECT(_r_preturn = query_result(q, n));
+   if(n == 0 && nmax >= 1) query_cursor_finalize(_r_pcursor);  // all lines read (a batch of no lines keeps the file open)
+   UNPROTECT(1);
+   return(_r_preturn);
+}
+
+static int region_cmp(const void *a, const void *b){
+  const px_region_t *x = (const px_region_t*)a, *y = (const px_region_t*)b;
+  if(x->tid != y->tid) return(x->tid < y->tid ? -1 : 1);
+  return(x->beg < y->beg ? -1 : x->beg > y->beg);
+}
+
+// write the lines of the regions r[0..n) of one tid (sorted by beg) that pass the row filters, in file order.
+// Overlapping regions are read with one iterator; a line in several regions is written once.
+// Returns the number of lines written, or -1 on a write error.
+static double extract_tid(query_t *q, ti_writer_t *w, const px_region_t *r, int n){
+  ti_index_t *idx = q->tb->idx;
+  uint64_t off, last = 0;
+  double nout = 0;
+  int i, j, k, len;
+  const char *s;
+  for(i=0;i<n;i=j){
+    int end = r[i].end;
+    for(j=i+1;j<n && r[j].beg < end;j++) if(r[j].end > end) end = r[j].end;
+    ti_iter_t iter = ti_iter_query(idx, r[i].tid, r[i].beg, end, -1, -1);
+    ti_iter_set_skip(iter, q->skip[0]);
+    while((s = ti_iter_read(q->tb->fp, iter, &len, 0)) != 0){
+      const ti_intv_t *intv = ti_iter_get_intv(iter);
+      ti_iter_get_pos(iter, &k, &off);
+      if(off <= last) continue;  // already written for a previous group of regions
+      if(q->filter.on && !row_passes(q, s, len, intv, 0)) continue;
+      for(k=i;k<j && r[k].beg < intv->end;k++) if(region_overlaps(r + k, intv)) break;
+      if(k==j || r[k].beg >= intv->end) continue;
+      if(ti_writer_write(w, s, len) < 0) { ti_iter_destroy(iter); return(-1); }
+      last = off;
+      nout++;
+    }
+    ti_iter_destroy(iter);
+  }
+  return(nout);
+}
+
+//.Call-compatible
+//write the lines of a set of queries to a new bgzipped file and build its index (.px2) in the same pass.
+//The header lines of the input file are copied first; the lines are written in file order, each line once.
+//A query covering a whole chromosome (pair) with no row filter copies the compressed blocks of that chromosome (pair)
+//without recompressing them (if the index has key statistics).
+//input:
+//  _r_pfn : input filename (a single character string)
+//  _r_pquery : queries, as in query_lines
+//  _r_poutfn : output filename (the index is written to <output filename>.px2)
+//  _r_popts : a named list of options (filter_cols, filter_ops, filter_values, min_distance, max_distance,
+//             sample_fraction, sample_col, sample_seed, as in query_lines)
+//output is an R list containing (flag, n).
+//  flag : 0 if successfully run, -1 if the input file can't be opened, -2 if the output file can't be written
+//  n : number of lines written (excluding the header)
+SEXP extract_lines(SEXP _r_pfn, SEXP _r_pquery, SEXP _r_poutfn, SEXP _r_popts){
+   query_t q;
+   SEXP _r_preturn;
+   double n = 0, m;
+   PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
+   PROTECT(_r_poutfn = AS_CHARACTER(_r_poutfn));
+   if(query_init(&q, CHAR(STRING_ELT(_r_pfn, 0)), _r_popts) == 0){
+     ti_index_t *idx = q.tb->idx;
+     const ti_conf_t *conf = ti_get_conf(idx);
+     const ti_chunkstats_t *cs = ti_get_chunkstats(idx);
+     const ti_keystat_t *ks = ti_get_keystats(idx);
+     int max_pos = ti_get_max_pos(), filtered = q.filter.on;
+     regionlist_t rl = {0,0,0};
+     kstring_t str = {0,0,0};
+     int i, j, k;
+     query_plan(&q, _r_pquery);
+     for(i=0;i<q.nquery;i++)
+       for(j=0;j<q.fwd[i].n;j++) { px_region_t *r = q.fwd[i].a + j; regionlist_add(&rl, r->tid, r->beg, r->end, r->beg2, r->end2); }
+     qsort(rl.a, rl.n, sizeof(px_region_t), region_cmp);
+
+     ti_writer_t *w = ti_writer_open(CHAR(STRING_ELT(_r_poutfn, 0)), conf, cs ? cs->col : 0, cs ? cs->ncols : 0);
+     if(!w) q.flag = -2;
+     else {
+       // header
+       bgzf_seek(q.tb->fp, 0, SEEK_SET);
+       for(k=0;ti_readline(q.tb->fp, &str) >= 0 && (k < conf->line_skip || str.s[0] == conf->meta_char);k++)
+         if(ti_writer_write(w, str.s, str.l) < 0) { q.flag = -2; break; }
+       for(i=0;i<rl.n && q.flag==0;i=j){
+         const px_region_t *r = rl.a + i;
+         int whole = 0;
+         for(j=i;j<rl.n && rl.a[j].tid == r->tid;j++)
+           if(rl.a[j].beg <= 0 && rl.a[j].end >= max_pos && (rl.a[j].beg2 <= 0 || rl.a[j].end2 == -1) && (rl.a[j].end2 >= max_pos || rl.a[j].end2 == -1)) whole = 1;
+         if(whole && !filtered && ks) {
+           if(ks[r->tid].n == 0) continue;
+           if(ti_writer_copy(w, q.tb->fp, ks[r->tid].off_beg, ks[r->tid].off_end) < 0) q.flag = -2;
+           else n += ks[r->tid].n;
+         } else if((m = extract_tid(&q, w, r, j-i)) < 0) q.flag = -2;
+         else n += m;
        }
-       destroy_sequential_iter(siter);
+       if(ti_writer_close(w, 0) < 0) q.flag = -2;
      }
-     ti_close(tb);
+     free(rl.a); free(str.s);
    }
-   else flag = -1; // error
-   
-   // output 
-   // preturn = (n, max_len, flag)
-   SEXP _r_preturn;
    PROTECT(_r_preturn = allocVector(VECSXP, 2));
-   SET_VECTOR_ELT(_r_preturn, 0, _r_presultstr);
+   SET_VECTOR_ELT(_r_preturn, 0, ScalarInteger(q.flag));
+   SET_VECTOR_ELT(_r_preturn, 1, ScalarReal(n));
+   query_destroy(&q);
+   UNPROTECT(3);
+   return(_r_preturn);
+}
+
+static void writer_finalize(SEXP _r_pwriter){
+  ti_writer_t *w = (ti_writer_t*)R_ExternalPtrAddr(_r_pwriter);
+  if(w) { ti_writer_close(w, 0); R_ClearExternalPtr(_r_pwriter); }
+}
+
+//.Call-compatible
+//open a bgzipped file to be written line by line with write_lines, and indexed in the same pass.
+//input : output file name, compression level (-1 for the default) and the index parameters as a named list
+//        (preset, cols, delimiter, comment_char, region_split_character, line_skip, statcols; see bgzip_file), or NULL for no index.
+//output is an R list containing (writer, flag).
+//  writer : an external pointer to the open file (NULL if flag is not 0)
+//  flag : 0 if successfully run, -2 if the output file can't be created, -7 or -8 as in bgzip_file
+SEXP open_writer(SEXP _r_pfn, SEXP _r_plevel, SEXP _r_popts){
+   SEXP _r_pwriter, _r_preturn, _r_pcols, _r_pstatcols;
+   ti_writer_t *w = 0;
+   ti_conf_t conf;
+   int flag = 0;
+   PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
+   PROTECT(_r_preturn = allocVector(VECSXP, 2));
+   const char *fn = CHAR(STRING_ELT(_r_pfn, 0));
+   if(isNull(_r_popts)) {
+     if(!(w = ti_writer_open2(fn, 0, 0, 0, asInteger(_r_plevel)))) flag = -2;
+   } else {
+     PROTECT(_r_pcols = AS_INTEGER(get_opt(_r_popts, "cols")));
+     PROTECT(_r_pstatcols = AS_INTEGER(get_opt(_r_popts, "statcols")));
+     flag = get_conf(fn, CHAR(STRING_ELT(get_opt(_r_popts, "preset"), 0)), INTEGER(_r_pcols), CHAR(STRING_ELT(get_opt(_r_popts, "delimiter"), 0))[0],
+                     CHAR(STRING_ELT(get_opt(_r_popts, "comment_char"), 0))[0], CHAR(STRING_ELT(get_opt(_r_popts, "region_split_character"), 0))[0],
+                     asInteger(get_opt(_r_popts, "line_skip")), &conf);
+     if(flag == -2) flag = -7;
+     else if(flag == -5) flag = -8;
+     else if(!(w = ti_writer_open2(fn, &conf, INTEGER(_r_pstatcols), length(_r_pstatcols), asInteger(_r_plevel)))) flag = -2;
+     UNPROTECT(2);
+   }
+   if(w){
+     PROTECT(_r_pwriter = R_MakeExternalPtr(w, R_NilValue, R_NilValue));
+     R_RegisterCFinalizerEx(_r_pwriter, writer_finalize, TRUE);
+     SET_VECTOR_ELT(_r_preturn, 0, _r_pwriter);
+     UNPROTECT(1);
+   }
+   SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(flag));
+   UNPROTECT(2);
+   return(_r_preturn);
+}
+
+//.Call-compatible
+//write lines (a character vector, without newlines) to a writer opened with open_writer.
+//output : 0 if successfully run, -1 if the lines can't be written or indexed (e.g. not sorted) or the writer is closed
+SEXP write_lines(SEXP _r_pwriter, SEXP _r_plines){
+   ti_writer_t *w = (ti_writer_t*)R_ExternalPtrAddr(_r_pwriter);
+   int i, n = length(_r_plines);
+   if(!w) return(ScalarInteger(-1));
+   for(i=0;i<n;i++){
+     SEXP _r_pline = STRING_ELT(_r_plines, i);
+     if(ti_writer_write(w, CHAR(_r_pline), LENGTH(_r_pline)) < 0) return(ScalarInteger(-1));
+   }
+   return(ScalarInteger(0));
+}
+
+//.Call-compatible
+//close a writer opened with open_writer and write the index (if any) to the output file name with '.px2' appended.
+//output : 0 if successfully run, -1 if the file or the index can't be written (or the lines were not sorted)
+SEXP close_writer(SEXP _r_pwriter){
+   ti_writer_t *w = (ti_writer_t*)R_ExternalPtrAddr(_r_pwriter);
+   int ret;
+   if(!w) return(ScalarInteger(-1));
+   R_ClearExternalPtr(_r_pwriter);
+   ret = ti_writer_close(w, 0);
+   return(ScalarInteger(ret));
+}
+
+// a row of the columns given to write_pairs, with its sort key
+typedef struct {
+  const char *chr1, *chr2;
+  double pos1;
+  R_xlen_t row;
+} pairs_row_t;
+
+// order of a pairs file index (chr1, chr2, pos1); ties keep the order of the rows
+static int pairs_row_cmp(const void *_a, const void *_b){
+  const pairs_row_t *a = (const pairs_row_t*)_a, *b = (const pairs_row_t*)_b;
+  int c = strcmp(a->chr1, b->chr1);
+  if(c == 0) c = strcmp(a->chr2, b->chr2);
+  if(c == 0) c = (a->pos1 > b->pos1) - (a->pos1 < b->pos1);
+  if(c == 0) c = (a->row > b->row) - (a->row < b->row);
+  return(c);
+}
 
-   // preturn_flag : flag
-   SEXP _r_preturn_flag;
-   PROTECT(_r_preturn_flag = NEW_INTEGER(1));
-   int *preturn_flag = INTEGER_POINTER(_r_preturn_flag);
-   preturn_flag[0] = flag;
+// append element i of a character, integer, numeric or logical vector
+static void kput_value(SEXP _r_pcol, R_xlen_t i, kstring_t *s){
+  char tmp[32];
+  switch(TYPEOF(_r_pcol)){
+    case STRSXP:
+      if(STRING_ELT(_r_pcol, i) == NA_STRING) kputs("NA", s);
+      else kputs(CHAR(STRING_ELT(_r_pcol, i)), s);
+      break;
+    case INTSXP:
+      if(INTEGER(_r_pcol)[i] == NA_INTEGER) kputs("NA", s);
+      else { snprintf(tmp, sizeof(tmp), "%d", INTEGER(_r_pcol)[i]); kputs(tmp, s); }
+      break;
+    case REALSXP:
+      if(ISNA(REAL(_r_pcol)[i])) kputs("NA", s);
+      else if(fabs(REAL(_r_pcol)[i]) < 1e15 && REAL(_r_pcol)[i] == floor(REAL(_r_pcol)[i])) { snprintf(tmp, sizeof(tmp), "%.0f", REAL(_r_pcol)[i]); kputs(tmp, s); }
+      else { snprintf(tmp, sizeof(tmp), "%.15g", REAL(_r_pcol)[i]); kputs(tmp, s); }
+      break;
+    case LGLSXP:
+      kputs(LOGICAL(_r_pcol)[i] == NA_LOGICAL ? "NA" : LOGICAL(_r_pcol)[i] ? "TRUE" : "FALSE", s);
+      break;
+  }
+}
 
-   SET_VECTOR_ELT(_r_preturn, 1, _r_preturn_flag);
+//.Call-compatible
+//sort the rows of a set of columns in the order of the pairs preset, write them as a bgzipped pairs file and index it in the same pass.
+//input : output file name, a list of columns (character, integer, numeric or logical vectors of the same length) in the order of the
+//        pairs format (readID, chr1, pos1, chr2, pos2, ...; chr1 and chr2 character vectors without NA, pos1 numeric),
+//        the header lines (a character vector), and the options as a named list (level : compression level, statcols : 0-based columns with chunk statistics).
+//output is an R list containing (flag, n).
+//  flag : 0 if successfully run, -2 if the output file or its index can't be written
+//  n : number of rows written
+SEXP write_pairs(SEXP _r_pfn, SEXP _r_pcols, SEXP _r_pheader, SEXP _r_popts){
+   SEXP _r_pchr1 = VECTOR_ELT(_r_pcols, 1), _r_ppos1 = VECTOR_ELT(_r_pcols, 2), _r_pchr2 = VECTOR_ELT(_r_pcols, 3), _r_pstatcols, _r_preturn;
+   R_xlen_t i, n = XLENGTH(_r_pchr1);
+   int j, ncols = length(_r_pcols), flag = 0;
+   pairs_row_t *rows;
+   kstring_t line = {0,0,0};
+   ti_writer_t *w;
 
-   UNPROTECT(7+*pn);
+   PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
+   PROTECT(_r_pstatcols = AS_INTEGER(get_opt(_r_popts, "statcols")));
+   w = ti_writer_open2(CHAR(STRING_ELT(_r_pfn, 0)), &ti_conf_pairs, INTEGER(_r_pstatcols), length(_r_pstatcols), asInteger(get_opt(_r_popts, "level")));
+   if(!w) flag = -2;
+   else {
+     // sort keys point to the R strings : no line is formatted before it is written
+     rows = malloc((n ? n : 1) * sizeof(pairs_row_t));
+     for(i=0;i<n;i++){
+       rows[i].chr1 = CHAR(STRING_ELT(_r_pchr1, i));
+       rows[i].chr2 = CHAR(STRING_ELT(_r_pchr2, i));
+       rows[i].pos1 = isReal(_r_ppos1) ? REAL(_r_ppos1)[i] : INTEGER(_r_ppos1)[i];
+       rows[i].row = i;
+     }
+     qsort(rows, n, sizeof(pairs_row_t), pairs_row_cmp);
+     for(i=0;i<length(_r_pheader) && flag==0;i++)
+       if(ti_writer_write(w, CHAR(STRING_ELT(_r_pheader, i)), LENGTH(STRING_ELT(_r_pheader, i))) < 0) flag = -2;
+     for(i=0;i<n && flag==0;i++){
+       line.l = 0;
+       for(j=0;j<ncols;j++){
+         if(j) kputc('\t', &line);
+         kput_value(VECTOR_ELT(_r_pcols, j), rows[i].row, &line);
+       }
+       if(ti_writer_write(w, line.s, line.l) < 0) flag = -2;
+     }
+     if(ti_writer_close(w, 0) < 0) flag = -2;
+     free(rows); free(line.s);
+   }
+   PROTECT(_r_preturn = allocVector(VECSXP, 2));
+   SET_VECTOR_ELT(_r_preturn, 0, ScalarInteger(flag));
+   SET_VECTOR_ELT(_r_preturn, 1, ScalarReal(flag == 0 ? (double)n : 0));
+   UNPROTECT(3);
    return(_r_preturn);
 }
 
+// sort a text file (plain text or gzip; "-" for the standard input) into a bgzipped file and index it in the same pass,
+// with the index parameters of bgzip_file. max_mem is the size of the runs sorted in memory, spilled to temporary files in tmpdir.
+// flag : 0 if successful, -1 if the input file can't be opened, -2 if the output or a temporary file can't be written,
+//        -3 if the input file can't be read, -5 if a line can't be parsed, -6 if the index can't be written,
+//        -7 if the preset is not recognized, -8 if no preset is given and the extension is not recognized.
+void sort_file(char **pinputfilename, char **poutputfilename, char **ptmpdir, double *pmax_mem, int *plevel, int *pthreads, int *pflag, char **ppreset, int *pcols, char **pdelimiter, char **pmeta_char, char **pregion_split_character, int *pline_skip, int *pstatcols, int *pnstatcols){
+  ti_conf_t conf;
+  *pflag = get_conf(*poutputfilename, *ppreset, pcols, (*pdelimiter)[0], (*pmeta_char)[0], (*pregion_split_character)[0], *pline_skip, &conf);
+  if(*pflag == -2) *pflag = -7;
+  else if(*pflag == -5) *pflag = -8;
+  else *pflag = ti_sort_file(*pinputfilename, *poutputfilename, &conf, 0, pstatcols, *pnstatcols, (size_t)*pmax_mem, *ptmpdir, *plevel, *pthreads);
+}
 
+// a key (chromosome or chromosome pair) of the merged files, with its tid in each file (-1 if absent)
+typedef struct {
+  const char *name;
+  int *tid;
+} merge_key_t;
 
-void build_index(char **pinputfilename, char **ppreset, int *psc, int *pbc, int *pec, int *psc2, int *pbc2, int *pec2, char **pdelimiter, char **pmeta_char, char **pregion_split_character, int *pline_skip, int *pforce, int *pflag){
+static char merge_split_character;
 
-  if(*pforce==0){
-    char *fnidx = calloc(strlen(*pinputfilename) + 5, 1);
-    strcat(strcpy(fnidx, *pinputfilename), ".px2");
-    struct stat stat_px2, stat_input;
-     if (stat(fnidx, &stat_px2) == 0){  // file exists.
-         // Before complaining, check if the input file isn't newer. This is a common source of errors,
-         // people tend not to notice that pairix failed
-         stat(*pinputfilename, &stat_input);
-         if ( stat_input.st_mtime <= stat_px2.st_mtime ) *pflag=-4;
+// keys are ordered by chromosome, then by second chromosome, as px_sort orders the lines
+static int merge_key_cmp(const void *_a, const void *_b){
+  const char *a = ((const merge_key_t*)_a)->name, *b = ((const merge_key_t*)_b)->name;
+  const char *sa = strchr(a, merge_split_character), *sb = strchr(b, merge_split_character);
+  int la = sa ? sa - a : strlen(a), lb = sb ? sb - b : strlen(b);
+  int c = memcmp(a, b, la < lb ? la : lb);
+  if(c == 0) c = la - lb;
+  if(c == 0 && sa && sb) c = strcmp(sa + 1, sb + 1);
+  return(c);
+}
+
+static int conf_equal(const ti_conf_t *a, const ti_conf_t *b){
+  return(a->preset == b->preset && a->sc == b->sc && a->bc == b->bc && a->ec == b->ec && a->sc2 == b->sc2 && a->bc2 == b->bc2 && a->ec2 == b->ec2
+         && a->delimiter == b->delimiter && a->region_split_character == b->region_split_character && a->meta_char == b->meta_char && a->line_skip == b->line_skip);
+}
+
+// current line of each file merged for a key
+typedef struct {
+  ti_iter_t iter;
+  const char *s;
+  int len, beg;
+} merge_src_t;
+
+// heap order: start of the current line, then file order
+static inline int merge_src_lt(const merge_src_t *src, int a, int b){
+  return(src[a].beg < src[b].beg || (src[a].beg == src[b].beg && a < b));
+}
+
+static void merge_heap_down(const merge_src_t *src, int *heap, int n, int i){
+  int k, tmp;
+  while((k = 2 * i + 1) < n){
+    if(k + 1 < n && merge_src_lt(src, heap[k + 1], heap[k])) ++k;
+    if(!merge_src_lt(src, heap[k], heap[i])) break;
+    tmp = heap[i]; heap[i] = heap[k]; heap[k] = tmp;
+    i = k;
+  }
+}
+
+static int merge_src_next(pairix_t *tb, merge_src_t *src){
+  if((src->s = ti_iter_read(tb->fp, src->iter, &src->len, 0)) == 0) return(-1);
+  src->beg = ti_iter_get_intv(src->iter)->beg;
+  return(0);
+}
+
+//.Call-compatible
+//merge pairix-indexed files with the same index parameters into one bgzipped file and build its index in the same pass.
+//The keys of all files are written in the order of px_sort; the lines of a key present in several files are merged by start
+//position (file order for ties). A key present in a single file is copied without recompressing its blocks, if the index
+//of that file has key statistics. The header lines of the first file are copied.
+//input : a character vector of file names, the output file name.
+//output is an R list containing (flag, n).
+//  flag : 0 if successfully run, -1 if an input file or its index can't be opened, -2 if the output file can't be written,
+//         -3 if the files are not indexed with the same parameters
+//  n : number of lines written (excluding the header)
+SEXP merge_files(SEXP _r_pfns, SEXP _r_poutfn){
+   SEXP _r_preturn;
+   int nf = length(_r_pfns), i, j, k, nkeys = 0, flag = 0, max_pos = ti_get_max_pos();
+   pairix_t **tb = calloc(nf, sizeof(pairix_t*));
+   merge_src_t *src = calloc(nf, sizeof(merge_src_t));
+   int *heap = malloc(nf * sizeof(int));
+   merge_key_t *keys = 0;
+   kstring_t str = {0,0,0};
+   ti_writer_t *w = 0;
+   double n = 0;
+
+   PROTECT(_r_pfns = AS_CHARACTER(_r_pfns));
+   PROTECT(_r_poutfn = AS_CHARACTER(_r_poutfn));
+   for(i=0;i<nf && flag==0;i++){
+     if(!(tb[i] = load((char*)CHAR(STRING_ELT(_r_pfns, i)))) || !tb[i]->idx) flag = -1;
+     else if(!conf_equal(ti_get_conf(tb[i]->idx), ti_get_conf(tb[0]->idx))) flag = -3;
+   }
+   if(flag == 0){
+     // union of the keys
+     khash_t(key) *h = kh_init(key);
+     for(i=0;i<nf;i++){
+       int nseq, ret;
+       const char **names = ti_seqname(tb[i]->idx, &nseq);
+       for(j=0;j<nseq;j++){
+         khint_t it = kh_put(key, h, names[j], &ret);
+         if(ret){
+           keys = realloc(keys, (nkeys + 1) * sizeof(merge_key_t));
+           keys[nkeys].name = names[j];
+           keys[nkeys].tid = malloc(nf * sizeof(int));
+           for(k=0;k<nf;k++) keys[nkeys].tid[k] = -1;
+           kh_val(h, it) = nkeys++;
+         }
+         keys[kh_val(h, it)].tid[i] = j;
+       }
+       free(names);
      }
-     free(fnidx);
+     kh_destroy(key, h);
+     merge_split_character = ti_get_region_split_character(tb[0]->idx);
+     qsort(keys, nkeys, sizeof(merge_key_t), merge_key_cmp);
+
+     const ti_conf_t *conf = ti_get_conf(tb[0]->idx);
+     const ti_chunkstats_t *cs = ti_get_chunkstats(tb[0]->idx);
+     if(!(w = ti_writer_open(CHAR(STRING_ELT(_r_poutfn, 0)), conf, cs ? cs->col : 0, cs ? cs->ncols : 0))) flag = -2;
+     else {
+       bgzf_seek(tb[0]->fp, 0, SEEK_SET);
+       for(k=0;ti_readline(tb[0]->fp, &str) >= 0 && (k < conf->line_skip || str.s[0] == conf->meta_char);k++)
+         if(ti_writer_write(w, str.s, str.l) < 0) { flag = -2; break; }
+     }
+     for(k=0;k<nkeys && flag==0;k++){
+       int nh = 0, single = -1;
+       for(i=0;i<nf;i++){
+         const ti_keystat_t *ks = ti_get_keystats(tb[i]->idx);
+         if(keys[k].tid[i] < 0 || (ks && ks[keys[k].tid[i]].n == 0)) continue;
+         single = nh++ == 0 && ks ? i : -1;  // the file, if the key is in only one file with key statistics
+       }
+       if(single >= 0){ // raw copy of the blocks of the key
+         const ti_keystat_t *ks = ti_get_keystats(tb[single]->idx) + keys[k].tid[single];
+         if(ti_writer_copy(w, tb[single]->fp, ks->off_beg, ks->off_end) < 0) flag = -2;
+         else n += ks->n;
+         continue;
+       }
+       for(i=0,nh=0;i<nf;i++){
+         if(keys[k].tid[i] < 0) continue;
+         src[i].iter = ti_iter_query(tb[i]->idx, keys[k].tid[i], 0, max_pos, -1, -1);
+         if(merge_src_next(tb[i], src + i) == 0) heap[nh++] = i;
+       }
+       for(i=nh/2-1;i>=0;i--) merge_heap_down(src, heap, nh, i);
+       while(nh > 0 && flag == 0){
+         merge_src_t *s = src + heap[0];
+         if(ti_writer_write(w, s->s, s->len) < 0) flag = -2;
+         else n++;
+         if(merge_src_next(tb[heap[0]], s) < 0) heap[0] = heap[--nh];
+         merge_heap_down(src, heap, nh, 0);
+       }
+       for(i=0;i<nf;i++) if(src[i].iter) { ti_iter_destroy(src[i].iter); src[i].iter = 0; }
+     }
+     if(w && ti_writer_close(w, 0) < 0) flag = -2;
+     for(k=0;k<nkeys;k++) free(keys[k].tid);
+     free(keys);
+   }
+   for(i=0;i<nf;i++) if(tb[i]) ti_close(tb[i]);
+   free(tb); free(src); free(heap); free(str.s);
+   PROTECT(_r_preturn = allocVector(VECSXP, 2));
+   SET_VECTOR_ELT(_r_preturn, 0, ScalarInteger(flag));
+   SET_VECTOR_ELT(_r_preturn, 1, ScalarReal(flag == 0 ? n : 0));
+   UNPROTECT(3);
+   return(_r_preturn);
+}
+
+
+// built-in accumulators of apply_file (see ti_apply)
+#define APPLY_COUNT 0      // lines per key
+#define APPLY_TABLE 1      // lines per combination of the values of some columns
+#define APPLY_HISTOGRAM 2  // values of a numeric column (or distances) in the intervals between breaks
+#define APPLY_COVERAGE 3   // mate positions in the bins of each chromosome
+
+KHASH_MAP_INIT_STR(tab, double)
+
+typedef struct {
+  int fun, nkeys;
+  const int *cols;        // table and histogram : 0-based columns; -1 for the distance |pos2 - pos1| (histogram)
+  int ncols, maxcol;
+  char delimiter;
+  const double *breaks;   // histogram
+  int nbreaks;
+  char *cis;              // histogram of distances : 1 for the keys whose mates are on the same chromosome
+  int *chr[2];            // coverage : chromosome of mate 1 and mate 2 of each key (-1 if not counted)
+  int nchr, bin_size;
+} apply_arg_t;
+
+typedef struct {
+  double *n;              // count : per key; histogram : per interval
+  int *fb, *fe;           // table and histogram : field boundaries of the current line
+  kstring_t key;          // table : values of the current line, joined with the delimiter
+  khash_t(tab) *tab;
+  double **bins;          // coverage : per chromosome
+  int *nbins, *mbins;
+} apply_acc_t;
+
+// the boundaries of the fields of a line up to column maxcol (0-based). Returns 0, or -1 if the line has fewer columns.
+static int split_fields(const char *s, int len, char delimiter, int maxcol, int *fb, int *fe){
+  int i, j=0, p=0;
+  for(i=0;i<=len && j<=maxcol;i++)
+    if(i==len || s[i]==delimiter) { fb[j]=p; fe[j++]=i; p=i+1; }
+  return(j > maxcol ? 0 : -1);
+}
+
+static void *apply_init(const ti_index_t *idx, void *arg){
+  const apply_arg_t *a = (const apply_arg_t*)arg;
+  apply_acc_t *acc = calloc(1, sizeof(apply_acc_t));
+  if(a->fun == APPLY_COUNT) acc->n = calloc(a->nkeys > 0 ? a->nkeys : 1, sizeof(double));
+  else if(a->fun == APPLY_HISTOGRAM) acc->n = calloc(a->nbreaks, sizeof(double));
+  else if(a->fun == APPLY_TABLE){
+    acc->tab = kh_init(tab);
+    acc->key.m = 64; acc->key.s = calloc(acc->key.m, 1);  // a key of empty values is still a string
   }
-  if(*pflag != -4){
-    if ( bgzf_is_bgzf(*pinputfilename)!=1 ) *pflag = -3;
-    else {
-      ti_conf_t conf;
-      if (strcmp(*ppreset, "") == 0 && *psc == 0 && *pbc == 0){
-        int l = strlen(*pinputfilename);
-        int strcasecmp(const char *s1, const char *s2);
-        if (l>=7 && strcasecmp(*pinputfilename+l-7, ".gff.gz") == 0) conf = ti_conf_gff;
-        else if (l>=7 && strcasecmp(*pinputfilename+l-7, ".bed.gz") == 0) conf = ti_conf_bed;
-        else if (l>=7 && strcasecmp(*pinputfilename+l-7, ".sam.gz") == 0) conf = ti_conf_sam;
-        else if (l>=7 && strcasecmp(*pinputfilename+l-7, ".vcf.gz") == 0) conf = ti_conf_vcf;
-        else if (l>=10 && strcasecmp(*pinputfilename+l-10, ".psltbl.gz") == 0) conf = ti_conf_psltbl;
-        else if (l>=9 && strcasecmp(*pinputfilename+l-9, ".pairs.gz") == 0) conf = ti_conf_pairs;
-        else *pflag = -5; // file extension not recognized and no preset specified
-      }
-      else if (strcmp(*ppreset, "") == 0 && *psc != 0 && *pbc != 0){
-        conf.sc = *psc;
-        conf.bc = *pbc;
-        conf.ec = *pec;
-        conf.sc2 = *psc2;
-        conf.bc2 = *pbc2;
-        conf.ec2 = *pec2;
-        conf.delimiter = (*pdelimiter)[0];
-        conf.region_split_character = (*pregion_split_character)[0];
-        conf.meta_char = (int)((*pmeta_char)[0]);
-        conf.line_skip = *pline_skip;
-      }
-      else if (strcmp(*ppreset, "gff") == 0) conf = ti_conf_gff;
-      else if (strcmp(*ppreset, "bed") == 0) conf = ti_conf_bed;
-      else if (strcmp(*ppreset, "sam") == 0) conf = ti_conf_sam;
-      else if (strcmp(*ppreset, "vcf") == 0 || strcmp(*ppreset, "vcf4") == 0) conf = ti_conf_vcf;
-      else if (strcmp(*ppreset, "psltbl") == 0) conf = ti_conf_psltbl;
-      else if (strcmp(*ppreset, "pairs") == 0) conf = ti_conf_pairs;
-      else if (strcmp(*ppreset, "merged_nodups") == 0) conf = ti_conf_merged_nodups;
-      else if (strcmp(*ppreset, "old_merged_nodups") == 0) conf = ti_conf_old_merged_nodups;
-      else *pflag = -2;  // wrong preset
-
-      // region_split_character overrides preset
-      if ((*pregion_split_character)[0] != DEFAULT_REGION_SPLIT_CHARACTER) conf.region_split_character = (*pregion_split_character)[0];
-
-      if (*pflag != -2 && *pflag != -5 ) *pflag= ti_index_build(*pinputfilename, &conf);  // -1 if failed
+  else {
+    acc->bins = calloc(a->nchr > 0 ? a->nchr : 1, sizeof(double*));
+    acc->nbins = calloc(a->nchr > 0 ? a->nchr : 1, sizeof(int));
+    acc->mbins = calloc(a->nchr > 0 ? a->nchr : 1, sizeof(int));
+  }
+  if(a->maxcol >= 0){
+    acc->fb = malloc((a->maxcol + 1) * sizeof(int));
+    acc->fe = malloc((a->maxcol + 1) * sizeof(int));
+  }
+  return(acc);
+}
+
+// add n to bin b of chromosome c, growing its bins as needed
+static void coverage_add(apply_acc_t *acc, int c, int b, double n){
+  if(b >= acc->mbins[c]){
+    int m = acc->mbins[c] ? acc->mbins[c] : 256;
+    while(m <= b) m <<= 1;
+    acc->bins[c] = realloc(acc->bins[c], m * sizeof(double));
+    memset(acc->bins[c] + acc->mbins[c], 0, (m - acc->mbins[c]) * sizeof(double));
+    acc->mbins[c] = m;
+  }
+  if(b >= acc->nbins[c]) acc->nbins[c] = b + 1;
+  acc->bins[c][b] += n;
+}
+
+// add n to the count of a combination of values
+static void table_add(apply_acc_t *acc, const char *key, double n){
+  int absent;
+  khint_t k = kh_put(tab, acc->tab, key, &absent);
+  if(absent) { kh_key(acc->tab, k) = strdup(key); kh_val(acc->tab, k) = 0; }
+  kh_val(acc->tab, k) += n;
+}
+
+static int apply_add(void *_acc, const char *s, int len, const ti_intv_t *intv, void *arg){
+  const apply_arg_t *a = (const apply_arg_t*)arg;
+  apply_acc_t *acc = (apply_acc_t*)_acc;
+  int j;
+  if(a->maxcol >= 0 && split_fields(s, len, a->delimiter, a->maxcol, acc->fb, acc->fe) < 0) return(0);
+  if(a->fun == APPLY_COUNT) acc->n[intv->tid]++;
+  else if(a->fun == APPLY_TABLE){
+    acc->key.l = 0;
+    for(j=0;j<a->ncols;j++){
+      if(j > 0) kputc(a->delimiter, &acc->key);
+      kputsn(s + acc->fb[a->cols[j]], acc->fe[a->cols[j]] - acc->fb[a->cols[j]], &acc->key);
+    }
+    table_add(acc, acc->key.s, 1);
+  } else if(a->fun == APPLY_HISTOGRAM){
+    double x;
+    int lo = 0, hi = a->nbreaks, mid;
+    if(a->cols[0] < 0){
+      if(!a->cis[intv->tid]) return(0);
+      x = fabs((double)intv->beg2 - intv->beg);
+    } else {
+      char *e;
+      x = strtod(s + acc->fb[a->cols[0]], &e);
+      if(e == s + acc->fb[a->cols[0]] || e != s + acc->fe[a->cols[0]]) return(0);  // not a number
     }
+    if(!(x >= a->breaks[0] && x <= a->breaks[a->nbreaks-1])) return(0);
+    while(lo < hi){ // the number of breaks at or before x
+      mid = (lo + hi) >> 1;
+      if(a->breaks[mid] <= x) lo = mid + 1;
+      else hi = mid;
+    }
+    acc->n[lo < a->nbreaks ? lo - 1 : a->nbreaks - 2]++;  // the last interval is closed on the right
+  } else {
+    if(a->chr[0][intv->tid] >= 0) coverage_add(acc, a->chr[0][intv->tid], intv->beg / a->bin_size, 1);
+    if(a->chr[1][intv->tid] >= 0 && intv->beg2 >= 0) coverage_add(acc, a->chr[1][intv->tid], intv->beg2 / a->bin_size, 1);
   }
+  return(0);
 }
 
+static void apply_merge(void *_acc, void *_other, void *arg){
+  const apply_arg_t *a = (const apply_arg_t*)arg;
+  apply_acc_t *acc = (apply_acc_t*)_acc, *other = (apply_acc_t*)_other;
+  int i, j;
+  khint_t k;
+  if(a->fun == APPLY_COUNT) for(i=0;i<a->nkeys;i++) acc->n[i] += other->n[i];
+  else if(a->fun == APPLY_HISTOGRAM) for(i=0;i<a->nbreaks-1;i++) acc->n[i] += other->n[i];
+  else if(a->fun == APPLY_TABLE){
+    for(k=kh_begin(other->tab);k!=kh_end(other->tab);k++)
+      if(kh_exist(other->tab, k)) table_add(acc, kh_key(other->tab, k), kh_val(other->tab, k));
+  } else {
+    for(i=0;i<a->nchr;i++)
+      for(j=other->nbins[i]-1;j>=0;j--) if(other->bins[i][j] > 0) coverage_add(acc, i, j, other->bins[i][j]);
+  }
+}
 
-// getting column names from header
-// works only for pairs
-SEXP get_column_names(SEXP _r_pfn){
+static void apply_destroy(void *_acc, void *arg){
+  const apply_arg_t *a = (const apply_arg_t*)arg;
+  apply_acc_t *acc = (apply_acc_t*)_acc;
+  int i;
+  khint_t k;
+  if(acc->tab){
+    for(k=kh_begin(acc->tab);k!=kh_end(acc->tab);k++) if(kh_exist(acc->tab, k)) free((char*)kh_key(acc->tab, k));
+    kh_destroy(tab, acc->tab);
+  }
+  if(acc->bins) for(i=0;i<a->nchr;i++) free(acc->bins[i]);
+  free(acc->bins); free(acc->nbins); free(acc->mbins);
+  free(acc->n); free(acc->fb); free(acc->fe); free(acc->key.s);
+  free(acc);
+}
+
+static const ti_accumulator_t apply_accumulator = { apply_init, apply_add, apply_merge, apply_destroy };
+
+//.Call-compatible
+//scan all the data lines of a file on several threads with a built-in accumulator, each thread reading its own ranges of
+//blocks (from the block offset table of the index), and merge the partial results of the threads.
+//input:
+//  _r_pfn : input filename (a single character string)
+//  _r_pfun : "count" (lines per key), "table" (lines per combination of the values of cols), "histogram" (values of
+//            cols[0] in the intervals between breaks, closed on the left, the last one also on the right) or "coverage"
+//            (positions of mate 1 and/or mate 2 in the bins of bin_size bp of each chromosome)
+//  _r_popts : a named list of options (threads, cols : 0-based columns, -1 for the distance |pos2 - pos1| of intra-chromosomal
+//             pairs; breaks : increasing numbers; bin_size; mate : 0 for both mates, 1 or 2)
+//output is an R list containing (result, flag).
+//  result : count : a list (key, chr1, chr2, count); table : a list of the values of each column, then the counts;
+//           histogram : the counts of the intervals; coverage : a list (chr, bin, count) of the bins (0-based) up to the last non-empty one
+//  flag : 0 if successfully run, -1 if the file can't be opened, -2 if the index has no block offset table (built by an older version),
+//         -3 on a read error, -4 if distances or mate 2 positions are asked for a 1D-indexed file
+SEXP apply_file(SEXP _r_pfn, SEXP _r_pfun, SEXP _r_popts){
 
    // file name
    char *pfn[1];
    PROTECT(_r_pfn = AS_CHARACTER(_r_pfn));
-   pfn[0] = R_alloc(strlen(CHAR(STRING_ELT(_r_pfn, 0))), sizeof(char));
+   pfn[0] = R_alloc(strlen(CHAR(STRING_ELT(_r_pfn, 0)))+1, sizeof(char));
    strcpy(pfn[0], CHAR(STRING_ELT(_r_pfn, 0)));
 
+   SEXP _r_pcols, _r_pbreaks, _r_presult = R_NilValue;
+   PROTECT(_r_pcols = AS_INTEGER(get_opt(_r_popts, "cols")));
+   PROTECT(_r_pbreaks = AS_NUMERIC(get_opt(_r_popts, "breaks")));
+   const char *fun = CHAR(STRING_ELT(_r_pfun, 0));
+   int flag=0, i, j, nprotect=3, mate = asInteger(get_opt(_r_popts, "mate"));
+   const char **keys = NULL, **chrs = NULL;
+   apply_acc_t *acc = NULL;
+   apply_arg_t a;
+   memset(&a, 0, sizeof(apply_arg_t));
+   a.fun = strcmp(fun, "count")==0 ? APPLY_COUNT : strcmp(fun, "table")==0 ? APPLY_TABLE : strcmp(fun, "histogram")==0 ? APPLY_HISTOGRAM : APPLY_COVERAGE;
+   a.cols = INTEGER(_r_pcols); a.ncols = length(_r_pcols);
+   a.breaks = REAL(_r_pbreaks); a.nbreaks = length(_r_pbreaks);
+   a.bin_size = asInteger(get_opt(_r_popts, "bin_size"));
+   if(a.bin_size == NA_INTEGER || a.bin_size < 1) a.bin_size = 1;
+   a.maxcol = -1;
+   if(a.fun == APPLY_TABLE || a.fun == APPLY_HISTOGRAM) for(i=0;i<a.ncols;i++) if(a.cols[i] > a.maxcol) a.maxcol = a.cols[i];
+
    pairix_t *tb = load(*pfn);
-   UNPROTECT(1);
+   if(tb && tb->idx){
+     int twod = ti_get_sc2(tb->idx) >= 0;
+     char region_split_character = ti_get_region_split_character(tb->idx);
+     a.delimiter = ti_get_delimiter(tb->idx);
+     keys = ti_seqname(tb->idx, &a.nkeys);
+     if(a.fun == APPLY_HISTOGRAM && a.cols[0] < 0){
+       if(!twod) flag = -4;
+       else {
+         a.cis = (char*)R_alloc(a.nkeys > 0 ? a.nkeys : 1, sizeof(char));
+         for(i=0;i<a.nkeys;i++){
+           const char *split = strchr(keys[i], region_split_character);
+           a.cis[i] = split && strncmp(keys[i], split + 1, split - keys[i])==0 && strlen(split + 1) == (size_t)(split - keys[i]);
+         }
+       }
+     }
+     if(a.fun == APPLY_COVERAGE){
+       // the chromosomes, in the order they first appear as mate 1, then as mate 2
+       khash_t(key) *h = kh_init(key);
+       int n1 = 0, n2 = 0, ret;
+       const char **names1 = ti_get_mate_names(tb->idx, 1, &n1), **names2 = twod ? ti_get_mate_names(tb->idx, 2, &n2) : NULL;
+       if(mate == 2 && !twod) flag = -4;
+       chrs = (const char**)R_alloc(n1 + n2 + 1, sizeof(char*));
+       for(i=0;i<n1+n2;i++){
+         const char *name = i < n1 ? names1[i] : names2[i-n1];
+         khint_t k = kh_put(key, h, name, &ret);
+         if(ret) { chrs[a.nchr] = name; kh_val(h, k) = a.nchr++; }
+       }
+       for(j=0;j<2;j++){
+         a.chr[j] = (int*)R_alloc(a.nkeys > 0 ? a.nkeys : 1, sizeof(int));
+         for(i=0;i<a.nkeys;i++){
+           const char *split = twod ? strchr(keys[i], region_split_character) : NULL;
+           kstring_t name = {0, 0, 0};
+           a.chr[j][i] = -1;
+           if((mate != 0 && mate != j + 1) || (j == 1 && !split)) continue;
+           if(j == 0) kputsn(keys[i], split ? split - keys[i] : strlen(keys[i]), &name);
+           else kputs(split + 1, &name);
+           khint_t k = kh_get(key, h, name.s);
+           if(k != kh_end(h)) a.chr[j][i] = kh_val(h, k);
+           free(name.s);
+         }
+       }
+       kh_destroy(key, h);
+     }
+     if(flag == 0){
+       int threads = asInteger(get_opt(_r_popts, "threads"));
+       int ret = ti_apply(*pfn, tb->idx, threads == NA_INTEGER ? 1 : threads, &apply_accumulator, &a, (void**)&acc);
+       if(ret < 0) flag = ret == -1 ? -2 : -3;
+     }
+   }
+   else flag = -1; // error
 
-   if(tb){
-     const ti_conf_t *pconf = ti_get_conf(tb->idx);
-     if(pconf->preset!=TI_PRESET_PAIRS)
-        return(R_NilValue);
- 
-     SEXP _r_presultstr;
-     PROTECT(_r_presultstr = allocVector(STRSXP, 1));
- 
-     const char *s;
-     int len;
-     sequential_iter_t *siter = ti_query_general(tb, 0, 0, 0);
-     while ((s = sequential_ti_read(siter, &len)) != 0) {
-       if ((int)(*s) != pconf->meta_char) break;
-       if(strncmp(s,"#columns: ",10)==0) { SET_STRING_ELT(_r_presultstr, 0, mkChar(s)); break; }
+   if(flag == 0){
+     if(a.fun == APPLY_COUNT){
+       char region_split_character = ti_get_region_split_character(tb->idx);
+       PROTECT(_r_presult = allocVector(VECSXP, 4)); nprotect++;
+       SEXP _r_pkey, _r_pchr1, _r_pchr2, _r_pcount;
+       SET_VECTOR_ELT(_r_presult, 0, _r_pkey = NEW_CHARACTER(a.nkeys));
+       SET_VECTOR_ELT(_r_presult, 1, _r_pchr1 = NEW_CHARACTER(a.nkeys));
+       SET_VECTOR_ELT(_r_presult, 2, _r_pchr2 = NEW_CHARACTER(a.nkeys));
+       SET_VECTOR_ELT(_r_presult, 3, _r_pcount = NEW_NUMERIC(a.nkeys));
+       for(i=0;i<a.nkeys;i++){
+         const char *split = ti_get_sc2(tb->idx) >= 0 ? strchr(keys[i], region_split_character) : NULL;
+         SET_STRING_ELT(_r_pkey, i, mkChar(keys[i]));
+         SET_STRING_ELT(_r_pchr1, i, split ? mkCharLen(keys[i], split - keys[i]) : mkChar(keys[i]));
+         SET_STRING_ELT(_r_pchr2, i, split ? mkChar(split + 1) : NA_STRING);
+         REAL(_r_pcount)[i] = acc->n[i];
+       }
+     } else if(a.fun == APPLY_TABLE){
+       int n = kh_size(acc->tab), r = 0;
+       khint_t k;
+       PROTECT(_r_presult = allocVector(VECSXP, a.ncols + 1)); nprotect++;
+       for(j=0;j<a.ncols;j++) SET_VECTOR_ELT(_r_presult, j, NEW_CHARACTER(n));
+       SET_VECTOR_ELT(_r_presult, a.ncols, NEW_NUMERIC(n));
+       for(k=kh_begin(acc->tab);k!=kh_end(acc->tab);k++){
+         if(!kh_exist(acc->tab, k)) continue;
+         const char *p = kh_key(acc->tab, k);
+         for(j=0;j<a.ncols;j++){
+           const char *e = strchr(p, a.delimiter);
+           if(!e || j == a.ncols - 1) e = p + strlen(p);
+           SET_STRING_ELT(VECTOR_ELT(_r_presult, j), r, mkCharLen(p, e - p));
+           p = *e ? e + 1 : e;
+         }
+         REAL(VECTOR_ELT(_r_presult, a.ncols))[r++] = kh_val(acc->tab, k);
+       }
+     } else if(a.fun == APPLY_HISTOGRAM){
+       PROTECT(_r_presult = NEW_NUMERIC(a.nbreaks - 1)); nprotect++;
+       for(i=0;i<a.nbreaks-1;i++) REAL(_r_presult)[i] = acc->n[i];
+     } else {
+       int n = 0, r = 0;
+       for(i=0;i<a.nchr;i++) n += acc->nbins[i];
+       PROTECT(_r_presult = allocVector(VECSXP, 3)); nprotect++;
+       SET_VECTOR_ELT(_r_presult, 0, NEW_CHARACTER(n));
+       SET_VECTOR_ELT(_r_presult, 1, NEW_NUMERIC(n));
+       SET_VECTOR_ELT(_r_presult, 2, NEW_NUMERIC(n));
+       for(i=0;i<a.nchr;i++){
+         SEXP _r_pchr = acc->nbins[i] > 0 ? mkChar(chrs[i]) : R_NilValue;
+         for(j=0;j<acc->nbins[i];j++,r++){
+           SET_STRING_ELT(VECTOR_ELT(_r_presult, 0), r, _r_pchr);
+           REAL(VECTOR_ELT(_r_presult, 1))[r] = j;
+           REAL(VECTOR_ELT(_r_presult, 2))[r] = acc->bins[i][j];
+         }
+       }
      }
-     destroy_sequential_iter(siter);
-     UNPROTECT(1);
-     return(_r_presultstr);
-   } else return(R_NilValue);
-     
-}
+     apply_destroy(acc, &a);
+   }
+   if(keys) free(keys);
+   if(tb) ti_close(tb);
 
+   // output
+   SEXP _r_preturn;
+   PROTECT(_r_preturn = allocVector(VECSXP, 2)); nprotect++;
+   SET_VECTOR_ELT(_r_preturn, 0, _r_presult);
+   SET_VECTOR_ELT(_r_preturn, 1, ScalarInteger(flag));
 
+   UNPROTECT(nprotect);
+   return(_r_preturn);
+}
+
+// register the C functions that other packages call through the wrappers of inst/include/Rpairix.h (LinkingTo: Rpairix).
+// The .C and .Call functions are still looked up by name.
+void R_init_Rpairix(DllInfo *dll){
+  R_RegisterCCallable("Rpairix", "ti_index_load", (DL_FUNC)ti_index_load);
+  R_RegisterCCallable("Rpairix", "ti_index_destroy", (DL_FUNC)ti_index_destroy);
+  R_RegisterCCallable("Rpairix", "ti_seqname", (DL_FUNC)ti_seqname);
+  R_RegisterCCallable("Rpairix", "ti_get_delimiter", (DL_FUNC)ti_get_delimiter);
+  R_RegisterCCallable("Rpairix", "ti_apply", (DL_FUNC)ti_apply);
+}